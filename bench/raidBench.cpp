@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "../include/TBlkDev.h"
+#include "../include/CRaidVolume.h"
+
+using namespace std;
+
+// Sectors of each simulated disk
+constexpr int BENCH_SECTORS = 16 * 1024;
+
+// Request sizes in sectors
+const int REQUEST_SIZES[] = {1, 8, 64, 256};
+
+// Read-ahead budget of the sequential read workload with prefetch
+constexpr size_t READ_AHEAD_BYTES = 4ULL << 20;
+
+// Upper bounds of one workload: requests and bytes transferred
+constexpr int MAX_REQUESTS = 4000;
+constexpr size_t MAX_BYTES = 64ULL << 20;
+
+// Backend shared by all disks, TBlkDev has no context pointer
+static vector<vector<unsigned char>> g_Memory;
+static int g_Files[MAX_RAID_DEVICES];
+static atomic<int> g_FailedDisk(NO_DISK);
+
+// Physical sectors transferred, for I/O amplification
+static atomic<long long> g_PhysicalSectors(0);
+
+int memRead(int device, TSector sectorNr, void *data, int sectorCnt) {
+    if (device == g_FailedDisk || sectorNr < 0 || sectorNr + sectorCnt > BENCH_SECTORS)
+        return 0;
+    memcpy(data, &g_Memory[device][(size_t) sectorNr * SECTOR_SIZE], (size_t) sectorCnt * SECTOR_SIZE);
+    g_PhysicalSectors += sectorCnt;
+    return sectorCnt;
+}
+
+int memWrite(int device, TSector sectorNr, const void *data, int sectorCnt) {
+    if (device == g_FailedDisk || sectorNr < 0 || sectorNr + sectorCnt > BENCH_SECTORS)
+        return 0;
+    memcpy(&g_Memory[device][(size_t) sectorNr * SECTOR_SIZE], data, (size_t) sectorCnt * SECTOR_SIZE);
+    g_PhysicalSectors += sectorCnt;
+    return sectorCnt;
+}
+
+int fileRead(int device, TSector sectorNr, void *data, int sectorCnt) {
+    if (device == g_FailedDisk || sectorNr < 0 || sectorNr + sectorCnt > BENCH_SECTORS)
+        return 0;
+    size_t len = (size_t) sectorCnt * SECTOR_SIZE;
+    if (pread(g_Files[device], data, len, (off_t) sectorNr * SECTOR_SIZE) != (ssize_t) len)
+        return 0;
+    g_PhysicalSectors += sectorCnt;
+    return sectorCnt;
+}
+
+int fileWrite(int device, TSector sectorNr, const void *data, int sectorCnt) {
+    if (device == g_FailedDisk || sectorNr < 0 || sectorNr + sectorCnt > BENCH_SECTORS)
+        return 0;
+    size_t len = (size_t) sectorCnt * SECTOR_SIZE;
+    if (pwrite(g_Files[device], data, len, (off_t) sectorNr * SECTOR_SIZE) != (ssize_t) len)
+        return 0;
+    g_PhysicalSectors += sectorCnt;
+    return sectorCnt;
+}
+
+// Fresh zeroed disks of a backend
+TBlkDev openBackend(bool file, int devices) {
+    TBlkDev dev{devices, BENCH_SECTORS, memRead, memWrite};
+    if (!file) {
+        g_Memory.assign(devices, vector<unsigned char>((size_t) BENCH_SECTORS * SECTOR_SIZE));
+        return dev;
+    }
+
+    for (int i = 0; i < devices; i++) {
+        char fn[32];
+        snprintf(fn, sizeof(fn), "tmp_disk%02d.bin", i);
+        g_Files[i] = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (g_Files[i] < 0 || ftruncate(g_Files[i], (off_t) BENCH_SECTORS * SECTOR_SIZE) != 0) {
+            perror(fn);
+            exit(1);
+        }
+    }
+    dev.m_Read = fileRead;
+    dev.m_Write = fileWrite;
+    return dev;
+}
+
+void closeBackend(bool file, int devices) {
+    g_Memory.clear();
+    if (file)
+        for (int i = 0; i < devices; i++) {
+            char fn[32];
+            snprintf(fn, sizeof(fn), "tmp_disk%02d.bin", i);
+            close(g_Files[i]);
+            unlink(fn);
+        }
+}
+
+// Latency percentile in microseconds
+double percentile(vector<double> &latencies, double p) {
+    if (latencies.empty())
+        return 0;
+    size_t idx = min(latencies.size() - 1, (size_t) (p * latencies.size()));
+    nth_element(latencies.begin(), latencies.begin() + idx, latencies.end());
+    return latencies[idx] * 1e6;
+}
+
+void report(const char *backend, int devices, const char *workload, int secCnt, int requests,
+            double seconds, vector<double> &latencies, long long logical) {
+    double amplification = logical ? (double) g_PhysicalSectors / logical : 0;
+    printf("%-7s %5d  %-14s %6d %10.0f %9.1f %9.1f %9.1f %6.2f\n", backend, devices, workload, secCnt,
+           requests / seconds, (double) logical * SECTOR_SIZE / seconds / 1e6,
+           percentile(latencies, 0.5), percentile(latencies, 0.99), amplification);
+}
+
+// Timed requests of one size, sequential or random over the whole volume
+void runWorkload(CRaidVolume &vol, const char *backend, int devices, const char *workload,
+                 bool isWrite, bool random, int secCnt) {
+    TSector volSize = vol.size();
+    int requests = (int) min<size_t>(MAX_REQUESTS, MAX_BYTES / ((size_t) secCnt * SECTOR_SIZE));
+    vector<unsigned char> buffer((size_t) secCnt * SECTOR_SIZE, 0xa5);
+    vector<double> latencies;
+    latencies.reserve(requests);
+    mt19937 rng(secCnt);
+    uniform_int_distribution<TSector> position(0, volSize - secCnt);
+
+    g_PhysicalSectors = 0;
+    auto begin = chrono::steady_clock::now();
+    TSector secNr = 0;
+    for (int r = 0; r < requests; r++) {
+        if (random)
+            secNr = position(rng);
+        else if (secNr + secCnt > volSize)
+            secNr = 0;
+
+        auto start = chrono::steady_clock::now();
+        bool valid = isWrite ? vol.write(secNr, buffer.data(), secCnt) : vol.read(secNr, buffer.data(), secCnt);
+        latencies.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        if (!valid) {
+            fprintf(stderr, "%s: request failed\n", workload);
+            exit(1);
+        }
+        secNr += secCnt;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+    report(backend, devices, workload, secCnt, requests, elapsed.count(), latencies,
+           (long long) requests * secCnt);
+}
+
+// Rebuild a replaced disk: MB/s of the rebuilt disk, amplification per rebuilt sector
+void runResync(CRaidVolume &vol, const char *backend, int devices) {
+    g_PhysicalSectors = 0;
+    auto begin = chrono::steady_clock::now();
+    if (vol.resync() != RAID_OK) {
+        fprintf(stderr, "resync failed\n");
+        exit(1);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+    vector<double> latencies{elapsed.count()};
+    long long rebuilt = vol.size() / (devices - 1);
+    report(backend, devices, "resync", 0, 1, elapsed.count(), latencies, rebuilt);
+}
+
+void runDevices(bool file, int devices) {
+    const char *backend = file ? "file" : "mem";
+    TBlkDev dev = openBackend(file, devices);
+    g_FailedDisk = NO_DISK;
+    if (!CRaidVolume::create(dev)) {
+        fprintf(stderr, "create failed\n");
+        exit(1);
+    }
+
+    CRaidVolume vol;
+    if (vol.start(dev) != RAID_OK) {
+        fprintf(stderr, "start failed\n");
+        exit(1);
+    }
+
+    for (int secCnt : REQUEST_SIZES) {
+        runWorkload(vol, backend, devices, "seq-write", true, false, secCnt);
+        runWorkload(vol, backend, devices, "seq-read", false, false, secCnt);
+        runWorkload(vol, backend, devices, "rand-write", true, true, secCnt);
+        runWorkload(vol, backend, devices, "rand-read", false, true, secCnt);
+    }
+
+    // Sequential reads again with read-ahead
+    vol.stop();
+    vol.setReadAhead(READ_AHEAD_BYTES);
+    if (vol.start(dev) != RAID_OK) {
+        fprintf(stderr, "start failed\n");
+        exit(1);
+    }
+    for (int secCnt : REQUEST_SIZES)
+        runWorkload(vol, backend, devices, "seq-read-ra", false, false, secCnt);
+
+    // Lose a disk, the first request notices it
+    g_FailedDisk = 0;
+    vector<unsigned char> probe((size_t) devices * SECTOR_SIZE);
+    vol.read(0, probe.data(), devices);
+    for (int secCnt : REQUEST_SIZES) {
+        runWorkload(vol, backend, devices, "degraded-write", true, true, secCnt);
+        runWorkload(vol, backend, devices, "degraded-read", false, true, secCnt);
+    }
+
+    // Replace the disk and rebuild it
+    g_FailedDisk = NO_DISK;
+    runResync(vol, backend, devices);
+
+    vol.stop();
+    closeBackend(file, devices);
+}
+
+// Usage: raidBench [mem|file|all] [disks]
+int main(int argc, char *argv[]) {
+    string backend = argc > 1 ? argv[1] : "all";
+    int minDevices = argc > 2 ? atoi(argv[2]) : 3;
+    int maxDevices = argc > 2 ? minDevices : MAX_RAID_DEVICES;
+    if ((backend != "mem" && backend != "file" && backend != "all") || minDevices < 3
+        || maxDevices > MAX_RAID_DEVICES) {
+        fprintf(stderr, "usage: %s [mem|file|all] [disks 3..%d]\n", argv[0], MAX_RAID_DEVICES);
+        return 1;
+    }
+
+    printf("%-7s %5s  %-14s %6s %10s %9s %9s %9s %6s\n", "backend", "disks", "workload", "sect",
+           "IOPS", "MB/s", "p50 us", "p99 us", "amp");
+    for (int file = 0; file < 2; file++) {
+        if (backend != "all" && (backend == "file") != (bool) file)
+            continue;
+        for (int devices = minDevices; devices <= maxDevices; devices++)
+            runDevices(file, devices);
+    }
+}
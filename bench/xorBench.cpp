@@ -0,0 +1,54 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "../include/TBlkDev.h"
+#include "../include/XorEngine.h"
+
+using namespace std;
+
+// Bytes XORed per measurement for each kernel and source count
+constexpr size_t TOTAL_BYTES = 1ULL << 30;
+
+// Measure throughput of one kernel in GB/s of source data consumed
+double measure(int kernel, int srcCnt, size_t len) {
+    vector<unsigned char> dst(len);
+    vector<vector<unsigned char>> buffers(srcCnt, vector<unsigned char>(len));
+    vector<const unsigned char *> src(srcCnt);
+    for (int i = 0; i < srcCnt; i++) {
+        for (size_t j = 0; j < len; j++)
+            buffers[i][j] = (unsigned char) rand();
+        src[i] = buffers[i].data();
+    }
+
+    size_t rounds = TOTAL_BYTES / (len * srcCnt) + 1;
+    auto begin = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        xorBlocks(kernel, dst.data(), src.data(), srcCnt, len);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+
+    // Keep the result alive
+    volatile unsigned char sink = dst[len / 2];
+    (void) sink;
+
+    return (double) rounds * len * srcCnt / elapsed.count() / 1e9;
+}
+
+int main() {
+    const int sources[] = {1, 2, 4, 8, MAX_RAID_DEVICES - 1};
+    const size_t lengths[] = {SECTOR_SIZE, 64 * 1024};
+
+    printf("selected kernel: %s\n", xorKernelName(xorKernel()));
+    printf("%-8s %8s %8s %10s\n", "kernel", "sources", "bytes", "GB/s");
+
+    for (int kernel = 0; kernel < XOR_KERNELS; kernel++) {
+        if (!xorSupported(kernel)) {
+            printf("%-8s %8s\n", xorKernelName(kernel), "n/a");
+            continue;
+        }
+        for (size_t len : lengths)
+            for (int srcCnt : sources)
+                printf("%-8s %8d %8zu %10.2f\n", xorKernelName(kernel), srcCnt, len,
+                       measure(kernel, srcCnt, len));
+    }
+}
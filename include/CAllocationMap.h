@@ -0,0 +1,60 @@
+#ifndef CALLOCATIONMAP_H
+#define CALLOCATIONMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "TBlkDev.h"
+
+// Allocation map: which stripes hold data. Released stripes read as zeros without I/O and are
+// skipped by resync and scrub; a released stripe is zeroed on the disks when written again.
+// A stripe changes only while its stripe lock is held exclusively and its rows are locked shared,
+// so queries under either lock need no lock of the map. Changes remember their map sector,
+// only those are written back.
+class CAllocationMap {
+public:
+    explicit CAllocationMap(TSector stripes);
+
+    CAllocationMap(const CAllocationMap &) = delete;
+
+    CAllocationMap &operator=(const CAllocationMap &) = delete;
+
+    bool mapped(TSector stripe) const {
+        return words[stripe / 64].load(std::memory_order_relaxed) >> stripe % 64 & 1;
+    }
+
+    // Any stripe of [first, last) holds data
+    bool any(TSector first, TSector last) const;
+
+    // Released stripes of [first, last)
+    std::vector<TSector> released(TSector first, TSector last) const;
+
+    // Mark stripes as holding data, returns the version that must be persisted before they are written
+    long long map(const std::vector<TSector> &stripes);
+
+    // Release stripes [first, last), returns the version that must be persisted
+    long long unmap(TSector first, TSector last);
+
+    // Mark every sector changed, e.g. for a renewed disk; returns the version that must be persisted
+    long long touchAll();
+
+    TSector mappedCount() const;
+
+    // Sectors changed since the last call, ascending, and their images with one bit per stripe;
+    // returns the version they bring the disks to
+    long long store(std::vector<int> &changed, std::vector<unsigned char> &sectors);
+
+    // Merge bits read from disk
+    void load(const unsigned char *sectors, int sectorCnt);
+
+private:
+    std::vector<std::atomic<uint64_t>> words; // a bit per stripe: neighbours change by atomic OR and AND
+    std::vector<bool> dirty;                  // a flag per map sector
+    TSector stripeCnt;
+    std::atomic<TSector> count;
+    long long version;
+    mutable std::mutex lock;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef CASYNCQUEUE_H
+#define CASYNCQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "TBlkDev.h"
+
+// Result of an asynchronous request drained by CRaidVolume::reap
+struct TRaidCompletion {
+    unsigned long long tag;
+    bool success;
+};
+
+// Requests of the asynchronous API. Requests touching disjoint stripes run concurrently,
+// a request conflicting with an earlier one (same stripe, at least one of them a write)
+// waits until the earlier one completes. A request that can be started without blocking
+// holds no worker while its I/O is in flight; the others run as a blocking operation on
+// one of at most MAX_ASYNC_WORKERS workers.
+class CAsyncQueue {
+public:
+    typedef std::function<bool()> Operation;
+    typedef std::function<void(bool)> Callback;
+
+    // Completes a started request from any thread; 'retry' runs its operation on a worker instead
+    typedef std::function<void(bool success, bool retry)> Finish;
+
+    // Starts a request without blocking, false if it has to run as an operation
+    typedef std::function<bool(const Finish &finish)> Start;
+
+    explicit CAsyncQueue(int depth);
+
+    // Waits for all submitted requests
+    ~CAsyncQueue();
+
+    CAsyncQueue(const CAsyncQueue &) = delete;
+
+    CAsyncQueue &operator=(const CAsyncQueue &) = delete;
+
+    // Fails when 'depth' requests are in flight or waiting to be reaped
+    bool submit(TSector firstStripe, TSector lastStripe, bool isWrite, Start start, Operation operation,
+                Callback callback, unsigned long long tag);
+
+    // Move up to 'maxCnt' completions out, block until at least 'minCnt' are available,
+    // no request that queues a completion is outstanding or interrupt() is called
+    int reap(TRaidCompletion *completions, int maxCnt, int minCnt);
+
+    // Wake blocked reap() calls, later ones no longer block
+    void interrupt();
+
+private:
+    enum RequestState {
+        REQUEST_WAITING,
+        REQUEST_RUNNING,   // started or its operation running
+        REQUEST_FINISHED,  // result known, completion not delivered yet
+        REQUEST_DELIVERING
+    };
+
+    struct Request {
+        TSector firstStripe;
+        TSector lastStripe;
+        bool isWrite;
+        RequestState state;
+        bool blocking; // start() is not tried (again)
+        bool success;
+        Start start;
+        Operation operation;
+        Callback callback;
+        unsigned long long tag;
+    };
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::list<Request> requests; // submission order, running and waiting
+    std::deque<TRaidCompletion> completions;
+    std::vector<std::thread> workers;
+    int depth;
+    bool stopped;
+    bool interrupted;
+
+    bool ready(std::list<Request>::iterator request);
+
+    void finish(std::list<Request>::iterator request, bool success, bool retry);
+
+    void run();
+};
+
+#endif
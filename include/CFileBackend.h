@@ -0,0 +1,60 @@
+#ifndef CFILEBACKEND_H
+#define CFILEBACKEND_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "TBlkDev.h"
+
+// Open flags of CFileBackend
+constexpr int BACKEND_DIRECT = 1; // O_DIRECT, unaligned buffers go through an aligned bounce buffer
+constexpr int BACKEND_URING = 2;  // io_uring, a transfer is split into requests submitted together, short ones resumed
+
+// Backends open at the same time, TBlkDev callbacks carry no context
+constexpr int MAX_FILE_BACKENDS = 8;
+
+// Member disks backed by files or block devices with positional I/O.
+// Each member may be used by one thread at a time per call, calls to different members run in parallel.
+class CFileBackend {
+public:
+    CFileBackend();
+
+    ~CFileBackend();
+
+    CFileBackend(const CFileBackend &) = delete;
+
+    CFileBackend &operator=(const CFileBackend &) = delete;
+
+    // Open one file or block device per member. Missing files are created with 'sectors' sectors,
+    // 0 takes the size of the smallest member. O_DIRECT and io_uring fall back to buffered
+    // pread/pwrite where the file system or kernel does not support them; O_DIRECT also where a
+    // member needs transfers aligned to more than a sector (4K logical blocks).
+    bool open(const std::vector<std::string> &paths, TSector sectors, int flags = 0);
+
+    void close();
+
+    // Callbacks for CRaidVolume, valid until close()
+    TBlkDev device() const;
+
+    // Flags in effect after fallbacks
+    int flags() const;
+
+    int read(int disk, TSector sector, void *data, int secCnt);
+
+    int write(int disk, TSector sector, const void *data, int secCnt);
+
+    // Release sectors of a member, 0 where the device or file system does not support it
+    int discard(int disk, TSector sector, TSector secCnt);
+
+private:
+    struct Member;
+
+    std::vector<std::unique_ptr<Member>> members;
+    TSector sectors;
+    int activeFlags;
+    int slot;
+
+    int transfer(int disk, TSector sector, unsigned char *data, int secCnt, bool isWrite);
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef CIOSCHEDULER_H
+#define CIOSCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// QoS classes of member I/O, highest priority first
+constexpr int IO_FOREGROUND = 0; // client requests, cache write-back, metadata
+constexpr int IO_REBUILD = 1;    // resync of a failed disk
+constexpr int IO_SCRUB = 2;      // parity verification
+constexpr int IO_CLASSES = 3;
+
+// Scheduling parameters of one class
+struct TIoClassConfig {
+    long long rate;  // bytes per second while clients are busy, 0 for no limit
+    long long burst; // bytes the token bucket holds, 0 for one second of 'rate'
+    int deadlineUs;  // I/O queued longer goes ahead of higher classes, 0 for none
+};
+
+// One worker thread per member disk dispatching queued I/O by class. Higher classes go first
+// unless their token bucket is empty, I/O past its deadline goes ahead of them. Background
+// classes ignore their bucket while no foreground I/O arrived for the idle threshold.
+class CIoScheduler {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    CIoScheduler(int disks, const TIoClassConfig *config, std::chrono::microseconds idleThreshold);
+
+    // Dispatch I/O still queued regardless of limits and join workers
+    ~CIoScheduler();
+
+    CIoScheduler(const CIoScheduler &) = delete;
+
+    CIoScheduler &operator=(const CIoScheduler &) = delete;
+
+    // Receives the time the I/O was queued and whether that exceeded the deadline of its class
+    typedef std::function<void(Clock::duration wait, bool late)> Task;
+
+    // Queue 'task' transferring 'bytes' on the worker of 'disk'
+    void submit(int disk, int ioClass, size_t bytes, Task task);
+
+    void configure(int ioClass, const TIoClassConfig &config);
+
+    void setIdleThreshold(std::chrono::microseconds threshold);
+
+    // No foreground I/O arrived within the idle threshold
+    bool idle() const;
+
+private:
+    struct Queued {
+        Task run;
+        size_t bytes;
+        Clock::time_point queued;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::condition_variable cv;
+        std::deque<Queued> tasks[IO_CLASSES];
+        bool stopped = false;
+        std::thread worker;
+    };
+
+    struct Bucket {
+        TIoClassConfig config;
+        double tokens; // bytes, negative while in debt
+        Clock::time_point refilled;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+
+    // Buckets are shared by all disks, the limits apply to the whole volume
+    mutable std::mutex bucketLock;
+    Bucket buckets[IO_CLASSES];
+    std::atomic<int> deadlines[IO_CLASSES]; // microseconds, read without the lock
+
+    std::atomic<long long> lastForeground; // steady clock nanoseconds
+    std::atomic<long long> idleThreshold;  // nanoseconds
+
+    bool idle(Clock::time_point now) const;
+
+    bool take(int ioClass, size_t bytes, Clock::time_point now, bool force, Clock::time_point &retry);
+
+    void wakeAll();
+
+    void run(Queue &queue);
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef CLOGSTORE_H
+#define CLOGSTORE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "TBlkDev.h"
+
+// Counters of the log-structured mode
+struct TLogStats {
+    TSector segments;
+    TSector freeSegments;
+    unsigned long long writtenSegments;  // segments appended to the log
+    unsigned long long cleanedSegments;  // segments reclaimed by cleaning
+    unsigned long long relocatedSectors; // live sectors copied forward by cleaning
+    unsigned long long checkpoints;      // map checkpoints written
+    TSector replayedSegments;            // segments replayed by the last start() on top of the checkpoint
+    TSector cachedMapPages;              // map pages in memory
+};
+
+// Log-structured layout over the RAID address space. Writes are appended to an open segment of
+// whole stripes kept in memory, written with no parity reads once full or flushed. An indirection
+// map gives the current location of every logical sector; a summary in front of each segment lists
+// the logical sectors it holds. Cleaning copies the live sectors of mostly stale segments forward
+// and reuses them.
+// The map is kept on disk in pages behind the segments, with a table of live sectors per segment;
+// only a bounded number of pages is cached. A checkpoint writes the changed pages and then a record
+// with the last segment they cover and the segments written next, so start() reads the record and
+// replays only the summaries of segments written after it.
+class CLogStore {
+public:
+    // Transfer 'count' sectors of the RAID address space from 'secNr'
+    typedef std::function<bool(TSector secNr, unsigned char *data, int count)> Fetch;
+    typedef std::function<bool(TSector secNr, const unsigned char *data, int count)> Store;
+
+    // Caller memory of sector 'i' of a request
+    typedef std::function<unsigned char *(int i)> Sector;
+
+    // Log over 'rawSectors' of whole stripes of 'stripeSectors', summaries tagged with 'logId';
+    // up to 'mapCache' bytes of map pages are cached
+    CLogStore(TSector rawSectors, int stripeSectors, unsigned logId, size_t mapCache, Fetch fetch, Store store);
+
+    // Stops the flusher, the open segment is not written
+    ~CLogStore();
+
+    CLogStore(const CLogStore &) = delete;
+
+    CLogStore &operator=(const CLogStore &) = delete;
+
+    // Logical sectors of a log over 'rawSectors', 0 if too small
+    static TSector logicalSize(TSector rawSectors, int stripeSectors);
+
+    TSector size() const {
+        return logical;
+    }
+
+    // Load the last checkpoint and replay the segments written after it, false if they cannot be read
+    bool recover();
+
+    bool read(TSector secNr, int secCnt, const Sector &sector);
+
+    bool write(TSector secNr, int secCnt, const Sector &sector);
+
+    // Write the open segment if it holds anything, then checkpoint the map
+    bool flush();
+
+    TLogStats stats() const;
+
+    // Write an idle open segment and clean ahead of demand in the background
+    void startFlusher();
+
+    void stopFlusher();
+
+private:
+    enum SegmentState : unsigned char {
+        SEGMENT_FREE,
+        SEGMENT_OPEN,    // filled in memory
+        SEGMENT_SEALED,  // being written
+        SEGMENT_USED,
+        SEGMENT_PENDING, // cleaned, freed once its live sectors moved forward are written
+        SEGMENT_PARKED   // freed, reused once a checkpoint no longer locates sectors in it
+    };
+
+    // Cached map page; 'version' counts changes so a checkpoint knows whether it wrote the latest
+    struct MapPage {
+        std::vector<TSector> entries; // empty while loading or if loading failed
+        bool loading = false;
+        bool dirty = false;
+        int pins = 0;
+        long long version = 0;
+        std::list<TSector>::iterator recent;
+    };
+
+    // Images written by one checkpoint
+    struct Checkpoint {
+        std::vector<TSector> mapPages;
+        std::vector<long long> versions;
+        std::vector<unsigned char> mapImage;
+        std::vector<TSector> tablePages;
+        std::vector<unsigned char> tableImage;
+        std::vector<unsigned char> record;
+        int slot;
+    };
+
+    int segmentSectors;
+    int summarySectors;
+    int slots;    // data sectors of a segment
+    TSector segments;
+    TSector logical;
+    TSector mapStart;   // map pages behind the segments, then table pages, then two checkpoint records
+    TSector tableStart;
+    TSector recordStart;
+    unsigned logId;
+    size_t mapCapacity; // pages
+    Fetch fetch;
+    Store store;
+
+    // Guards everything below except 'readers'
+    mutable std::mutex lock;
+
+    // Serializes segment writes, checkpoints and cleaning
+    std::mutex writeLock;
+
+    // Held shared while reading located sectors, exclusively before a cleaned segment is reused
+    std::shared_timed_mutex readers;
+
+    // Map: logical sector -> address segment * slots + slot, -1 if never written
+    std::unordered_map<TSector, MapPage> pages;
+    std::list<TSector> recentPages; // most recently used first
+    std::vector<bool> mapStored;    // map page may hold entries on disk
+    size_t dirtyPages;
+    std::condition_variable loaded;
+
+    std::vector<int> live;          // live sectors of each segment, a hint for cleaning after a crash
+    std::vector<SegmentState> state;
+    std::vector<bool> tableDirty;   // per table page
+    size_t dirtyTables;
+    std::deque<std::pair<TSector, long long>> pending; // cleaned segment, segments written before it is freed
+    std::deque<TSector> nextSegments; // opened in this order, as listed by the last checkpoint
+    TSector freeCount;        // free and parked segments
+    TSector scanFrom;         // where the next checkpoint looks for free segments
+    long long sequence;       // of the next segment written
+    long long sealed;         // segments sealed so far
+    long long written;        // segments written so far
+    long long checkpointSealed; // segments sealed when the last checkpoint was taken
+    long long checkpointNumber;
+    int recordSlot;           // written by the next checkpoint
+    bool broken;              // a checkpoint failed, nothing more is appended
+
+    // Segment images: summary, then slots
+    TSector openSegment;
+    int openFill;
+    std::vector<unsigned char> openData;
+    std::vector<TSector> openLogicals; // logical sector of each filled slot
+    TSector sealedSegment;
+    std::vector<unsigned char> sealedData;
+
+    TLogStats counters;
+    std::chrono::steady_clock::time_point lastWrite;
+
+    std::condition_variable wake;
+    std::thread flusher;
+    bool stopping;
+
+    static void geometry(TSector rawSectors, int stripeSectors, int &segmentSectors, int &summarySectors,
+                         TSector &segments, TSector &logical);
+
+    bool pin(const std::vector<TSector> &pageNrs);
+
+    void unpin(const std::vector<TSector> &pageNrs);
+
+    void evict();
+
+    TSector lookup(TSector secNr) const;
+
+    void remap(TSector secNr, TSector address);
+
+    void place(TSector secNr, const unsigned char *data);
+
+    void release(TSector address);
+
+    void changed(TSector segment);
+
+    void openNext();
+
+    bool seal(bool onlyFull, bool checkpoint = false);
+
+    void snapshot(Checkpoint &checkpoint);
+
+    bool writeCheckpoint(const Checkpoint &checkpoint);
+
+    bool clean(size_t target, int maxLive);
+
+    void summarize(int fill);
+
+    bool parse(const unsigned char *summary, long long &seq, TSector *logicals, unsigned *sums) const;
+
+    bool parseRecord(const unsigned char *record, long long &number, long long &seq, std::vector<TSector> &listed) const;
+};
+
+#endif
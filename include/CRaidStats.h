@@ -0,0 +1,122 @@
+#ifndef CRAIDSTATS_H
+#define CRAIDSTATS_H
+
+#include <atomic>
+#include <chrono>
+#include "TBlkDev.h"
+#include "CIoScheduler.h"
+
+// Latency histogram: bucket 0 counts I/Os under 1 us, bucket i those in [2^(i-1), 2^i) us,
+// the last bucket everything slower
+constexpr int LATENCY_BUCKETS = 24;
+
+// Counters of one member disk
+struct TDiskStats {
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long readBytes;
+    unsigned long long writtenBytes;
+    unsigned long long errors;
+    unsigned long long hedgedReads; // reads evaluated from the other members because this disk was late
+    bool slow;                      // tail latency far above the typical member, see setHedgedReads()
+    unsigned long long latency[LATENCY_BUCKETS];
+};
+
+// Member I/O of one QoS class as dispatched by the scheduler
+struct TIoClassStats {
+    unsigned long long ios;
+    unsigned long long bytes;
+    unsigned long long waitUs;    // total time queued
+    unsigned long long maxWaitUs;
+    unsigned long long lateIos;   // queued past the deadline of the class
+};
+
+// Counters of a volume since it was constructed or the last reset
+struct TRaidStats {
+    int devices;
+    unsigned long long reads;           // logical requests
+    unsigned long long writes;
+    unsigned long long readSectors;     // logical sectors
+    unsigned long long writtenSectors;
+    unsigned long long physicalIos;     // calls to member disks
+    double iosPerRequest;               // physical I/Os per logical request
+    unsigned long long fullRows;        // parity rows written completely, no reads
+    unsigned long long reconstructRows; // parity evaluated from untouched data
+    unsigned long long readModifyRows;  // parity updated from old data and parity
+    unsigned long long dataOnlyRows;    // parity disk failed
+    unsigned long long reconstructedSectors; // degraded reads evaluated from parity
+    TSector resyncSector;               // rebuilt sectors of the failed disk
+    TSector resyncTotal;                // sectors to rebuild, 0 unless degraded
+    double resyncRate;                  // sectors per second of the running resync
+    unsigned long long scrubbedRows;    // parity rows verified by scrub
+    unsigned long long scrubMismatches; // rows whose parity did not match their data
+    unsigned long long scrubRepaired;   // mismatching parity rewritten
+    TSector scrubSector;                // rows verified by the running scrub
+    TSector scrubTotal;                 // rows to verify, 0 unless scrubbing
+    TSector mappedStripes;              // stripes holding data, every stripe without an allocation map
+    TIoClassStats classes[IO_CLASSES];  // indexed by IO_FOREGROUND, IO_REBUILD, IO_SCRUB
+    bool clientsIdle;                   // background classes run unthrottled, see setIdleThreshold()
+    TDiskStats disks[MAX_RAID_DEVICES];
+};
+
+// Low-overhead counters updated on the I/O path, read by snapshot()
+class CRaidStats {
+public:
+    CRaidStats();
+
+    CRaidStats(const CRaidStats &) = delete;
+
+    CRaidStats &operator=(const CRaidStats &) = delete;
+
+    void request(bool isWrite, int sectors);
+
+    void diskIo(int disk, bool isWrite, int sectors, bool success, std::chrono::nanoseconds latency);
+
+    void dispatched(int ioClass, size_t bytes, std::chrono::nanoseconds wait, bool late);
+
+    // A read of 'disk' was served from the other members
+    void hedged(int disk);
+
+    // Upper bound in microseconds of the latency 'percentile' (0..1) of recent I/Os of 'disk',
+    // 0 while the disk has too few I/Os for it
+    unsigned long long latencyPercentile(int disk, double percentile) const;
+
+    void rows(int full, int reconstruct, int readModify, int dataOnly);
+
+    void reconstructed(int sectors);
+
+    void scrubbed(int rows, int mismatches, int repaired);
+
+    // Resync begins or resumes at 'sector', for its rate
+    void resyncStarted(TSector sector);
+
+    // Counters only, resync progress is filled in by the volume
+    TRaidStats snapshot() const;
+
+    double resyncRate(TSector sector) const;
+
+    void reset();
+
+private:
+    struct Disk {
+        std::atomic<unsigned long long> reads, writes, readBytes, writtenBytes, errors, hedgedReads;
+        std::atomic<unsigned long long> latency[LATENCY_BUCKETS];
+        std::atomic<unsigned long long> recent[LATENCY_BUCKETS]; // decaying, see diskIo()
+        std::atomic<unsigned long long> samples;
+    };
+
+    std::atomic<unsigned long long> reads, writes, readSectors, writtenSectors;
+    std::atomic<unsigned long long> fullRows, reconstructRows, readModifyRows, dataOnlyRows;
+    std::atomic<unsigned long long> reconstructedSectors;
+    std::atomic<unsigned long long> scrubbedRows, scrubMismatches, scrubRepaired;
+    struct IoClass {
+        std::atomic<unsigned long long> ios, bytes, waitUs, maxWaitUs, lateIos;
+    };
+
+    IoClass classes[IO_CLASSES];
+    std::atomic<long long> resyncStart; // steady clock nanoseconds
+    std::atomic<TSector> resyncStartSector;
+    Disk disks[MAX_RAID_DEVICES];
+};
+
+#endif
@@ -1,13 +1,49 @@
 #ifndef CRAIDVOLUME_H
 #define CRAIDVOLUME_H
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
 #include "TBlkDev.h"
+#include "Overhead.h"
+#include "CAsyncQueue.h"
+#include "CIoScheduler.h"
+#include "CLogStore.h"
+#include "CRaidStats.h"
+#include "CRangeLock.h"
+#include "CReadAhead.h"
+#include "CStripeCache.h"
+#include "CStripeMap.h"
+#include "CWriteBitmap.h"
 
+// Layout options of create()
+constexpr int RAID_ALLOCATION_MAP = 1; // track stripes holding data, see discard()
+constexpr int RAID_LOG_STRUCTURED = 2; // append writes as whole stripes through an indirection map
+
+class CCompletion;
+
+class CAllocationMap;
+
+// RAID 5 volume. I/O, flush, resync and stats may be called from any number of threads;
+// requests touching different stripes run in parallel, stop() waits for requests in progress.
 class CRaidVolume {
 public:
     CRaidVolume();
 
-    static bool create(const TBlkDev &dev);
+    ~CRaidVolume();
+
+    // Stripe unit 'chunkSize' in bytes, a multiple of SECTOR_SIZE up to MAX_CHUNK_SIZE.
+    // 'bitmapRegion' bytes of each disk per write-intent bitmap bit, a multiple of SECTOR_SIZE; 0 for no bitmap.
+    // 'flags' of RAID_ALLOCATION_MAP: all stripes start released, see discard(); RAID_LOG_STRUCTURED:
+    // writes are buffered and appended to a log of whole stripes, see logStats(), the volume is
+    // smaller by the space cleaning and the stored map need
+    static bool create(const TBlkDev &dev, int chunkSize = SECTOR_SIZE, int bitmapRegion = 0, int flags = 0);
 
     int start(const TBlkDev &dev);
 
@@ -15,33 +51,349 @@ public:
 
     int resync();
 
+    // Rebuild in the background while read/write continue; false if not degraded or already running
+    bool startResync();
+
+    // Wait for a background resync, returns the RAID state
+    int waitResync();
+
+    // Sectors of the failed disk rebuilt so far
+    TSector resyncProgress() const;
+
+    // Verify parity of every row in the background and rewrite mismatching parity if 'repair';
+    // an interrupted scrub resumes where it stopped. False unless the RAID is OK or if already running
+    bool startScrub(bool repair = false);
+
+    // Interrupt a background scrub, its progress is kept
+    void cancelScrub();
+
+    // Wait for a background scrub, returns the RAID state
+    int waitScrub();
+
+    // Cap scrub I/O in bytes and member I/Os per second, 0 for no limit; applies to a running scrub
+    void setScrubLimit(long long bytesPerSecond, int iosPerSecond);
+
+    // Scheduling of member I/O of a class: IO_FOREGROUND, IO_REBUILD or IO_SCRUB; applies at once
+    void setIoClass(int ioClass, const TIoClassConfig &config);
+
+    // Rebuild and scrub ignore their rate once clients issued no I/O for 'microseconds'
+    void setIdleThreshold(int microseconds);
+
+    // Hedged reads: a member read still missing after the 'percentile' (0..1) latency of the typical
+    // member, but at least 'minDeadlineUs', is also evaluated from the other members and the first
+    // result wins. Only while the RAID is OK and without stripe cache; 0 disables. Applies at once.
+    void setHedgedReads(double percentile, int minDeadlineUs = 1000);
+
     int status() const;
 
-    int size() const;
+    TSector size() const;
+
+    bool read(TSector secNr, void *data, int secCnt);
+
+    bool write(TSector secNr, const void *data, int secCnt);
+
+    // Scatter-gather variants: sectors map straight onto the segments, the total length must be
+    // whole sectors; only sectors split between segments are copied
+    bool readv(TSector secNr, const iovec *iov, int iovCnt);
+
+    bool writev(TSector secNr, const iovec *iov, int iovCnt);
+
+    // Release the whole stripes of a range: they read as zeros without I/O, resync and scrub skip
+    // them and members with m_Discard discard their rows. Sectors of partly covered stripes keep
+    // their data. Needs a volume created with an allocation map, not log-structured.
+    bool discard(TSector secNr, TSector secCnt);
+
+    // Asynchronous I/O: the request completes through 'callback' if given, otherwise its
+    // completion is queued for reap(). Fails if the queue depth is exhausted or RAID not running.
+    // Reads of a healthy volume without cache, log, allocation map, read-ahead or hedged reads are
+    // queued on the disk schedulers and hold no thread while in flight; writes and other reads run
+    // on at most 16 blocking workers, further requests wait for one of them.
+    // Buffers must stay valid until completion. Synchronous read/write are atomic per stripe
+    // against requests in flight, but not ordered.
+    bool submitRead(TSector secNr, void *data, int secCnt, unsigned long long tag,
+                    std::function<void(bool)> callback = nullptr);
+
+    bool submitWrite(TSector secNr, const void *data, int secCnt, unsigned long long tag,
+                     std::function<void(bool)> callback = nullptr);
+
+    // Drain up to 'maxCnt' completions, block until at least 'minCnt' are available or every
+    // outstanding request is reaped; returns early when the RAID is being stopped
+    int reap(TRaidCompletion *completions, int maxCnt, int minCnt = 0);
+
+    // Requests in flight or waiting to be reaped, applies from the next start()
+    void setQueueDepth(int depth);
+
+    // Resync and scrub save their progress to overhead every 'sectors' processed sectors
+    void setResyncCheckpoint(int sectors);
+
+    // Memory budget of the write-back stripe cache, 0 disables it; applies from the next start()
+    void setCacheSize(size_t bytes);
+
+    TCacheStats cacheStats() const;
+
+    // Memory budget of sequential read-ahead, 0 disables it; applies from the next start()
+    void setReadAhead(size_t bytes);
+
+    TReadAheadStats readAheadStats() const;
 
-    bool read(int secNr, void *data, int secCnt);
+    // Memory budget of the cached map pages of a log-structured volume; applies from the next start()
+    void setLogMapCache(size_t bytes);
 
-    bool write(int secNr, const void *data, int secCnt);
+    // Segments of a log-structured volume, zeros otherwise
+    TLogStats logStats() const;
+
+    // Per-disk and per-volume counters; counters are read one by one, not as an atomic snapshot
+    TRaidStats stats() const;
+
+    void resetStats();
+
+    // Write dirty cached rows and the open log segment to the disks, also done in the background and by stop()
+    bool flush();
 
 private:
     struct RAID {
         TBlkDev dev;
-        int state;
-        int failedDisk;
+        std::atomic<int> state;
+        std::atomic<int> failedDisk;
         int timestamp;
+        int chunkSectors;
+        std::atomic<TSector> resyncSector; // failed disk is valid below this sector, see resync()
+        int bitmapSectors;
+        int regionSectors;
+        std::atomic<TSector> scrubSector; // rows below are verified by the current scrub pass
+        int allocSectors;
+        int logId;
+        int volumeId;
     } raid;
 
-    struct Evaluation {
-        int sector;
+    // Held shared by requests, exclusively by start() and stop();
+    // 'stopping' turns new requests away so stop() is not starved
+    mutable std::shared_timed_mutex runLock;
+    std::atomic<bool> stopping;
+
+    // Serializes state transitions
+    mutable std::mutex stateLock;
+
+    // Serializes overhead writes so the newest state lands last
+    std::mutex overheadLock;
+
+    // Bumped when the failed disk fails again, a running resync then gives up
+    int failEpoch;
+
+    // Bumped by every member failure; a request retries a window only after one
+    std::atomic<unsigned> memberErrors;
+
+    // Physical sectors being rebuilt (exclusive) or written (shared)
+    CRangeLock rowLocks;
+
+    // Stripes being written (exclusive) or read (shared), fair so readers cannot starve writers
+    CRangeLock stripeLocks;
+
+    // Logical to physical mapping of the running RAID
+    CStripeMap stripeMap;
+
+    CRaidStats statistics;
+
+    // Serializes control of the resync and scrub threads
+    std::mutex resyncLock;
+    std::thread resyncThread;
+    std::atomic<bool> resyncRunning;
+    std::atomic<bool> resyncCancel;
+
+    std::thread scrubThread;
+    std::atomic<bool> scrubRunning;
+    std::atomic<bool> scrubCancel;
+    std::atomic<long long> scrubBytesLimit;
+    std::atomic<int> scrubIopsLimit;
+
+    // Paced scrub sleeps here, woken early when cancelled
+    std::mutex scrubPaceLock;
+    std::condition_variable scrubPace;
+
+    int queueDepth;
+
+    int resyncCheckpoint;
+
+    size_t cacheSize;
+
+    size_t readAheadSize;
+
+    size_t logMapCache;
+
+    // Serializes cache write-back so rows reach the disks in order
+    std::mutex flushLock;
+
+    // Serializes QoS settings, the scheduler is configured from them when started
+    std::mutex qosLock;
+    TIoClassConfig ioClasses[IO_CLASSES];
+    int idleThreshold; // microseconds
+
+    std::atomic<double> hedgePercentile;
+    std::atomic<int> hedgeMinDeadline; // microseconds
+
+    // Per-disk workers dispatching member I/O by QoS class, exist while the RAID is running
+    std::unique_ptr<CIoScheduler> scheduler;
+
+    // Optional write-intent bitmap, exists while the RAID is running
+    std::unique_ptr<CWriteBitmap> bitmap;
+
+    // Serializes bitmap writes, 'bitmapVersion' is on the disks
+    std::mutex bitmapLock;
+    long long bitmapVersion;
+
+    // Optional allocation map, exists while the RAID is running
+    std::unique_ptr<CAllocationMap> allocation;
+
+    // Serializes allocation map writes, 'allocationVersion' is on the disks
+    std::mutex allocationLock;
+    long long allocationVersion;
+
+    // Optional stripe cache, exists while the RAID is running
+    std::unique_ptr<CStripeCache> cache;
+
+    // Optional read-ahead, exists while the RAID is running
+    std::unique_ptr<CReadAhead> readAhead;
+
+    // Log of a log-structured volume, exists while the RAID is running
+    std::unique_ptr<CLogStore> logStore;
+
+    // Asynchronous requests, destroyed before the cache and workers they use
+    std::unique_ptr<CAsyncQueue> asyncQueue;
+
+    enum WritePlan {
+        WRITE_READ_MODIFY,  // read old data and parity, update parity in place
+        WRITE_RECONSTRUCT,  // read untouched data, evaluate parity from scratch
+        WRITE_DATA_ONLY     // parity disk failed, write data only
+    };
+
+    // One physical sector of a batched transfer
+    struct SectorIo {
         int disk;
-        int diskParity;
+        TSector sector;
+        unsigned char *data;
     };
 
-    Evaluation findSector(int input) const;
+    // Caller memory of a request: contiguous, or one pointer per sector for scatter-gather
+    struct IoBuffer {
+        unsigned char *data;
+        unsigned char *const *sectors;
+
+        unsigned char *at(int i) const {
+            return sectors ? sectors[i] : data + (size_t) i * SECTOR_SIZE;
+        }
+
+        IoBuffer from(int i) const {
+            return sectors ? IoBuffer{nullptr, sectors + i} : IoBuffer{data + (size_t) i * SECTOR_SIZE, nullptr};
+        }
+    };
+
+    bool readSectors(TSector secNr, IoBuffer buffer, int secCnt);
+
+    bool readThrough(TSector secNr, IoBuffer buffer, int secCnt);
+
+    bool writeSectors(TSector secNr, IoBuffer buffer, int secCnt);
+
+    bool writeThrough(TSector secNr, IoBuffer buffer, int secCnt);
+
+    static bool mapSegments(const iovec *iov, int iovCnt, std::vector<unsigned char *> &sectors,
+                            std::vector<unsigned char> &bounce, bool scatter);
+
+    bool enter(std::shared_lock<std::shared_timed_mutex> &running);
+
+    bool inRange(TSector secNr, TSector secCnt) const;
+
+    bool flushCache();
+
+    int rebuild();
+
+    void cancelResync();
+
+    void scrub(bool repair);
+
+    bool readRange(TSector secNr, IoBuffer data, int secCnt);
+
+    TSector stripeCount() const;
+
+    Overhead currentOverhead() const;
+
+    bool submit(TSector secNr, unsigned char *data, int secCnt, bool isWrite, unsigned long long tag,
+                std::function<void(bool)> callback);
+
+    int degradedDisk() const;
+
+    int failedDiskAt(TSector sector, int failedDisk) const;
+
+    WritePlan planRow(int diskParity, int first, int count, int failedDisk) const;
+
+    // Parity row of a write: data disks [first, first + count) of a sector within the chunk
+    struct WriteRow {
+        TSector stripe;
+        int offset;
+        int first;
+        int count;
+        WritePlan plan;
+        int failedDisk; // disk that is not read or written
+    };
+
+    std::vector<WriteRow> planRows(TSector secNr, int secCnt, int failedDisk) const;
+
+    bool writeCached(TSector secNr, IoBuffer data, const std::vector<WriteRow> &rows, int failedDisk);
+
+    bool writeRange(TSector secNr, IoBuffer data, int secCnt);
+
+    bool readBatch(std::vector<SectorIo> &batch, int ioClass = IO_FOREGROUND);
+
+    bool writeBatch(std::vector<SectorIo> &batch, int ioClass = IO_FOREGROUND);
+
+    // Consecutive sectors of one disk transferred in a single call
+    struct DiskRun {
+        int disk;
+        TSector sector;
+        int count;
+        unsigned char *data;
+        bool done;
+    };
+
+    bool transferBatch(std::vector<SectorIo> &batch, bool isWrite, int ioClass = IO_FOREGROUND);
+
+    static void coalesce(std::vector<SectorIo> &batch, bool isWrite, std::vector<DiskRun> &runs,
+                         std::vector<size_t> &ends, std::vector<unsigned char> &staging);
+
+    static void scatter(const std::vector<SectorIo> &batch, const std::vector<DiskRun> &runs,
+                        const std::vector<size_t> &ends);
+
+    bool startRead(TSector secNr, unsigned char *data, int secCnt, const CAsyncQueue::Finish &finish);
+
+    bool transferRuns(std::vector<DiskRun> &runs, bool isWrite, int ioClass = IO_FOREGROUND);
+
+    void startRuns(std::vector<DiskRun> &runs, bool isWrite, CCompletion &completion,
+                   int ioClass = IO_FOREGROUND);
+
+    bool readHedged(std::vector<DiskRun> &runs);
+
+    unsigned long long typicalLatency(double percentile) const;
+
+    bool finishRuns(const std::vector<DiskRun> &runs);
+
+    void saveOverhead();
+
+    void saveBitmap(long long version);
+
+    void allocate(TSector secNr, int secCnt, TSector firstStripe, TSector lastStripe, int failedDisk);
+
+    void saveAllocation(long long version);
+
+    void clearBitmap(bool force);
+
+    bool bitmapCovers(int disk);
+
+    void repairParity();
+
+    bool myRead(int disk, TSector sector, unsigned char *data, int secCnt = 1);
 
-    bool myRead(int disk, int sector, unsigned char *data);
+    bool myWrite(int disk, TSector sector, const unsigned char *data, int secCnt = 1);
 
-    bool myWrite(int disk, int sector, const unsigned char *data);
+    bool markFailed(int disk);
 };
 
 #endif
@@ -0,0 +1,67 @@
+#ifndef CRANGELOCK_H
+#define CRANGELOCK_H
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include "TBlkDev.h"
+
+// Shared/exclusive locks on ranges [first, last) of sectors or stripes.
+// Overlapping ranges conflict when at least one of them is exclusive.
+// Unlocking wakes only the waiters whose range overlaps the released one.
+class CRangeLock {
+public:
+    // A fair lock also makes a request wait for conflicting requests queued before it,
+    // so a stream of readers cannot starve a writer. Only for callers that hold one range at a time.
+    explicit CRangeLock(bool fair = false);
+
+    // Block until the range can be held, returns its handle
+    int lock(TSector first, TSector last, bool exclusive);
+
+    void unlock(int handle);
+
+private:
+    struct Range {
+        TSector first;
+        TSector last;
+        bool exclusive;
+        int handle;
+    };
+
+    // A blocked lock() call
+    struct Waiter {
+        TSector first;
+        TSector last;
+        bool exclusive;
+        std::condition_variable released;
+    };
+
+    std::mutex guard;
+    std::list<Range> held;
+    std::list<Waiter *> waiting; // arrival order
+    int nextHandle;
+    bool fair;
+
+    bool conflicts(TSector first, TSector last, bool exclusive, std::list<Waiter *>::const_iterator queued) const;
+};
+
+// Holds a range for the lifetime of the object
+class CRangeGuard {
+public:
+    CRangeGuard(CRangeLock &ranges, TSector first, TSector last, bool exclusive)
+            : ranges(ranges), handle(ranges.lock(first, last, exclusive)) {}
+
+    ~CRangeGuard() {
+        ranges.unlock(handle);
+    }
+
+    CRangeGuard(const CRangeGuard &) = delete;
+
+    CRangeGuard &operator=(const CRangeGuard &) = delete;
+
+private:
+    CRangeLock &ranges;
+    int handle;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef CREADAHEAD_H
+#define CREADAHEAD_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "TBlkDev.h"
+
+// Counters of read-ahead
+struct TReadAheadStats {
+    unsigned long long hitSectors;       // requested sectors served from prefetched data
+    unsigned long long missSectors;      // requested sectors read from the disks
+    unsigned long long prefetchedSectors;
+    unsigned long long discardedSectors; // prefetched and dropped unused: evicted or overwritten
+    int streams;                         // sequential streams being followed
+};
+
+// Sequential stream detection and prefetch of logical sectors. Each stream that reads
+// where its previous read ended gets a window of whole stripes loaded ahead of it on a
+// background thread; the window doubles while reads keep hitting prefetched data.
+class CReadAhead {
+public:
+    // Loads 'count' logical sectors from 'secNr' into 'data', bypassing read-ahead
+    typedef std::function<bool(TSector secNr, unsigned char *data, int count)> Fetch;
+
+    // Receives 'count' prefetched sectors for request sectors from 'offset'
+    typedef std::function<void(int offset, const unsigned char *data, int count)> Copy;
+
+    // 'budget' bytes of prefetched data, windows are whole stripes of 'stripeSectors' within 'volumeSectors'
+    CReadAhead(size_t budget, int stripeSectors, TSector volumeSectors, Fetch fetch);
+
+    // Waits for the prefetch in progress
+    ~CReadAhead();
+
+    CReadAhead(const CReadAhead &) = delete;
+
+    CReadAhead &operator=(const CReadAhead &) = delete;
+
+    // Serve leading sectors of a read from prefetched data, waiting for ones being loaded,
+    // then follow the stream of the read. Returns the sectors served.
+    int read(TSector secNr, int secCnt, const Copy &copy);
+
+    // Sectors [first, last) were written, prefetched copies are stale
+    void invalidate(TSector first, TSector last);
+
+    TReadAheadStats stats() const;
+
+private:
+    struct Stream {
+        TSector next;        // sector after the last read
+        int window;          // sectors kept loaded ahead of 'next'
+        TSector prefetchEnd; // end of the prefetch issued so far
+        long long used;  // access clock, the least recently used stream is replaced
+    };
+
+    struct Extent {
+        TSector first;
+        int count;
+        bool ready;
+        bool stale; // overwritten while loading, dropped when loaded
+        int used;   // sectors served
+        std::vector<unsigned char> data;
+    };
+
+    int stripeSectors;
+    TSector volumeSectors;
+    int maxWindow;
+    size_t capacity; // sectors
+    size_t loadedSectors;
+    Fetch fetch;
+
+    mutable std::mutex lock;
+    std::condition_variable changed;
+    std::vector<Stream> streams;
+    long long clock;
+    std::list<Extent> extents; // oldest first
+    std::deque<std::list<Extent>::iterator> pending;
+    TReadAheadStats counters;
+    std::thread worker;
+    bool stopping;
+
+    std::list<Extent>::iterator find(TSector sector);
+
+    void follow(TSector secNr, int secCnt, bool hit);
+
+    bool prefetch(TSector first, TSector last, long long used);
+
+    void drop(std::list<Extent>::iterator extent);
+
+    void run();
+};
+
+#endif
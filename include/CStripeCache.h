@@ -0,0 +1,90 @@
+#ifndef CSTRIPECACHE_H
+#define CSTRIPECACHE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "TBlkDev.h"
+
+// Counters of the stripe cache
+struct TCacheStats {
+    unsigned long long readHits;
+    unsigned long long readMisses;
+    unsigned long long writeHits;
+    unsigned long long writeMisses;
+    unsigned long long flushedRows;
+    unsigned long long evictions;
+};
+
+// LRU write-back cache of parity rows. A row is the same physical sector of every disk:
+// all data sectors and the parity sector are kept, so writes update parity in memory.
+class CStripeCache {
+public:
+    // 'budget' bytes of row data, at least one row
+    CStripeCache(int devices, size_t budget);
+
+    ~CStripeCache();
+
+    CStripeCache(const CStripeCache &) = delete;
+
+    CStripeCache &operator=(const CStripeCache &) = delete;
+
+    // Copy the sector of 'disk' in 'row' to 'data' if the row is cached
+    bool read(TSector row, int disk, unsigned char *data);
+
+    // Apply new data of 'cnt' disks to a cached row and update its parity, false on miss
+    bool write(TSector row, int diskParity, const int *disks, const unsigned char *const *data, int cnt);
+
+    // Insert a complete row, 'sectors' holds one sector per disk
+    void insert(TSector row, const unsigned char *sectors, uint32_t dirty);
+
+    // Take up to 'maxRows' dirty rows for writing: row numbers, dirty disk masks and row copies
+    int collect(std::vector<TSector> &rows, std::vector<uint32_t> &masks, std::vector<unsigned char> &sectors,
+                int maxRows);
+
+    // Rows taken by collect() were written
+    void release(const std::vector<TSector> &rows);
+
+    // Drop rows [first, last) whether dirty or not, none may be collected for writing
+    void discard(TSector first, TSector last);
+
+    // Drop clean rows from the LRU tail until within budget, false if dirty rows prevent it
+    bool evict();
+
+    TCacheStats stats() const;
+
+    // Periodically call 'flush', sooner when many rows are dirty
+    void startFlusher(std::function<void()> flush);
+
+    void stopFlusher();
+
+private:
+    struct Entry {
+        TSector row;
+        uint32_t dirty;  // disks whose sector differs from the disk
+        int flushing;    // collected and not yet released, must not be evicted
+        std::vector<unsigned char> sectors;
+    };
+
+    int devices;
+    size_t capacity; // rows
+    size_t dirtyRows;
+
+    mutable std::mutex lock;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<TSector, std::list<Entry>::iterator> index;
+    TCacheStats counters;
+
+    std::condition_variable wake;
+    std::thread flusher;
+    bool stopping;
+
+    std::list<Entry>::iterator find(TSector row);
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef CSTRIPEMAP_H
+#define CSTRIPEMAP_H
+
+#include <algorithm>
+#include <vector>
+#include "TBlkDev.h"
+
+// Logical sectors of one chunk: consecutive physical sectors of one disk
+struct TStripeSegment {
+    int offset;     // index of the first sector within the mapped range
+    int disk;
+    TSector sector; // physical sector on 'disk'
+    int count;
+    int diskParity; // parity disk of the row
+    TSector stripe;
+};
+
+// Logical to physical mapping of a RAID 5 geometry. A rotation table lists the data disks of
+// each parity position, so a range is walked chunk by chunk with divisions only at its start.
+// Common disk counts get a walk specialized at compile time.
+class CStripeMap {
+public:
+    CStripeMap();
+
+    CStripeMap(int devices, int chunkSectors);
+
+    int stripeSectors() const {
+        return stripeSize;
+    }
+
+    // Segment holding logical sector 'secNr', one sector long
+    TStripeSegment locate(TSector secNr) const;
+
+    // Call 'visit' with each segment of [secNr, secNr + secCnt) in logical order
+    template<typename Visit>
+    void forEach(TSector secNr, int secCnt, Visit &&visit) const {
+        switch (devices) {
+            case 3:
+                walk<3>(secNr, secCnt, visit);
+                break;
+            case 4:
+                walk<4>(secNr, secCnt, visit);
+                break;
+            case 5:
+                walk<5>(secNr, secCnt, visit);
+                break;
+            case 6:
+                walk<6>(secNr, secCnt, visit);
+                break;
+            case 8:
+                walk<8>(secNr, secCnt, visit);
+                break;
+            default:
+                walk<0>(secNr, secCnt, visit);
+        }
+    }
+
+private:
+    int devices;
+    int chunkSectors;
+    int stripeSize;
+
+    // Data disks in logical order for each parity disk: rotation[parity * (devices - 1) + index]
+    std::vector<int> rotation;
+
+    // 'Devices' is the disk count known at compile time, 0 reads it at run time
+    template<int Devices, typename Visit>
+    void walk(TSector secNr, int secCnt, Visit &visit) const {
+        const int diskCnt = Devices ? Devices : devices;
+        const int dataDisks = diskCnt - 1;
+        TSector stripe = secNr / stripeSize;
+        int within = (int) (secNr - stripe * stripeSize);
+        int index = within / chunkSectors;
+        int inChunk = within - index * chunkSectors;
+        int parity = (int) (stripe % diskCnt);
+        TSector row = stripe * chunkSectors;
+        const int *disks = &rotation[parity * dataDisks];
+
+        for (int done = 0; done < secCnt;) {
+            int count = std::min(chunkSectors - inChunk, secCnt - done);
+            visit(TStripeSegment{done, disks[index], row + inChunk, count, parity, stripe});
+            done += count;
+            inChunk = 0;
+            if (++index < dataDisks)
+                continue;
+            // Next stripe: parity moves to the next disk
+            index = 0;
+            stripe++;
+            row += chunkSectors;
+            if (++parity == diskCnt)
+                parity = 0;
+            disks = &rotation[parity * dataDisks];
+        }
+    }
+};
+
+#endif
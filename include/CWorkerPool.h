@@ -0,0 +1,57 @@
+#ifndef CWORKERPOOL_H
+#define CWORKERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Countdown latch: join on operations fanned out to several disks. 'finished' runs on the thread
+// of the last operation, which may destroy the latch from it.
+class CCompletion {
+public:
+    explicit CCompletion(int count, std::function<void()> finished = nullptr);
+
+    void done();
+
+    void wait();
+
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    int pending;
+    std::function<void()> finished;
+};
+
+// Worker threads with a submission queue each, used to spread XOR work of resync and scrub.
+// Tasks of one lane run in submission order, different lanes run in parallel.
+class CWorkerPool {
+public:
+    explicit CWorkerPool(int lanes);
+
+    ~CWorkerPool();
+
+    CWorkerPool(const CWorkerPool &) = delete;
+
+    CWorkerPool &operator=(const CWorkerPool &) = delete;
+
+    void submit(int lane, std::function<void()> task);
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> tasks;
+        bool stopped = false;
+        std::thread worker;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+
+    static void run(Queue &queue);
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef CWRITEBITMAP_H
+#define CWRITEBITMAP_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "TBlkDev.h"
+
+// Write-intent bitmap: one bit per region of physical rows, set before a region is written
+// and cleared lazily once it is idle. Set bits are the only rows that may be inconsistent
+// after a crash, or stale on a disk that dropped out of the RAID.
+class CWriteBitmap {
+public:
+    CWriteBitmap(TSector regions, int regionSectors);
+
+    ~CWriteBitmap();
+
+    CWriteBitmap(const CWriteBitmap &) = delete;
+
+    CWriteBitmap &operator=(const CWriteBitmap &) = delete;
+
+    // Mark rows [first, last) dirty, returns the version that must be persisted before writing them
+    long long begin(TSector first, TSector last);
+
+    // Writes to rows [first, last) are finished
+    void end(TSector first, TSector last);
+
+    // Any region of rows [first, last) is dirty
+    bool dirty(TSector first, TSector last) const;
+
+    bool empty() const;
+
+    // Clear dirty regions idle since the previous call, or every idle region if 'force'.
+    // 'allowed' is checked once finished writes are accounted for. Returns true if bits changed.
+    bool clearIdle(bool force, const std::function<bool()> &allowed);
+
+    // Serialize the bits into 'sectorCnt' sectors, returns the version stored
+    long long store(unsigned char *sectors, int sectorCnt) const;
+
+    // Merge bits read from disk
+    void load(const unsigned char *sectors, int sectorCnt);
+
+    // Periodically call 'clear' to drop idle regions
+    void startCleaner(std::function<void()> clear);
+
+    void stopCleaner();
+
+private:
+    enum RegionState : unsigned char {
+        REGION_CLEAN,
+        REGION_DIRTY,
+        REGION_IDLE  // dirty without writes since the last clearIdle()
+    };
+
+    int regionSectors;
+    std::vector<RegionState> regions;
+    std::vector<int> inFlight;
+    std::vector<long long> setVersion; // version that set the bit
+    long long version;
+
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    std::thread cleaner;
+    bool stopping;
+};
+
+#endif
@@ -2,20 +2,86 @@
 #define OVERHEAD_H
 
 #include "TBlkDev.h"
+#include <cstdint>
 #include <cstring>
 
+// Marks overhead written with the extended layout, older volumes only have the first three fields
+constexpr int OVERHEAD_MAGIC = 0x52354f48;
+
 struct Overhead {
     int state;
     int failedDisk;
     int timestamp;
+    int chunkSectors; // stripe unit in sectors
+    TSector resyncSector; // sectors of 'failedDisk' already rebuilt by an interrupted resync
+    int bitmapSectors; // write-intent bitmap in front of the overhead sector, 0 if none
+    int regionSectors; // physical rows per bitmap bit
+    TSector scrubSector;   // rows already verified by an interrupted scrub
+    int allocSectors;  // allocation map in front of the bitmap, 0 if none
+    int logId;         // tags segment summaries of a log-structured volume, 0 if not
+    int volumeId;      // random id of the array, 0 if created before ids
 };
 
+// A sector number is stored as its low word at 'low' and high word at 'high', in int units;
+// volumes written before 64-bit sectors hold zero in the high word
+inline TSector readSector(const unsigned char *buffer, int low, int high) {
+    uint32_t words[2];
+    std::memcpy(&words[0], buffer + sizeof(int) * low, sizeof(int));
+    std::memcpy(&words[1], buffer + sizeof(int) * high, sizeof(int));
+    return (TSector) ((uint64_t) words[1] << 32 | words[0]);
+}
+
+inline void writeSector(TSector sector, unsigned char *buffer, int low, int high) {
+    uint32_t words[2] = {(uint32_t) sector, (uint32_t) ((uint64_t) sector >> 32)};
+    std::memcpy(buffer + sizeof(int) * low, &words[0], sizeof(int));
+    std::memcpy(buffer + sizeof(int) * high, &words[1], sizeof(int));
+}
+
 inline Overhead readFromBuffer(const unsigned char buffer[SECTOR_SIZE]) {
     Overhead overhead{};
+    int magic;
     std::memcpy(&(overhead.timestamp), buffer, sizeof(int));
     std::memcpy(&(overhead.state), buffer + sizeof(int), sizeof(int));
     std::memcpy(&(overhead.failedDisk), buffer + sizeof(int) * 2, sizeof(int));
+    std::memcpy(&magic, buffer + sizeof(int) * 3, sizeof(int));
+
+    // Volume created before chunk size was configurable
+    if (magic != OVERHEAD_MAGIC) {
+        overhead.chunkSectors = 1;
+        return overhead;
+    }
+
+    std::memcpy(&(overhead.chunkSectors), buffer + sizeof(int) * 4, sizeof(int));
+    overhead.resyncSector = readSector(buffer, 5, 11);
+    std::memcpy(&(overhead.bitmapSectors), buffer + sizeof(int) * 6, sizeof(int));
+    std::memcpy(&(overhead.regionSectors), buffer + sizeof(int) * 7, sizeof(int));
+    overhead.scrubSector = readSector(buffer, 8, 12);
+    std::memcpy(&(overhead.allocSectors), buffer + sizeof(int) * 9, sizeof(int));
+    std::memcpy(&(overhead.logId), buffer + sizeof(int) * 10, sizeof(int));
+    std::memcpy(&(overhead.volumeId), buffer + sizeof(int) * 13, sizeof(int));
     return overhead;
 }
 
+// Replace only the state of an overhead sector, the layout words are kept as they are
+inline void writeStateToBuffer(int state, unsigned char buffer[SECTOR_SIZE]) {
+    std::memcpy(buffer + sizeof(int), &state, sizeof(int));
+}
+
+inline void writeToBuffer(const Overhead &overhead, unsigned char buffer[SECTOR_SIZE]) {
+    int magic = OVERHEAD_MAGIC;
+    std::memset(buffer, 0, SECTOR_SIZE);
+    std::memcpy(buffer, &(overhead.timestamp), sizeof(int));
+    std::memcpy(buffer + sizeof(int), &(overhead.state), sizeof(int));
+    std::memcpy(buffer + sizeof(int) * 2, &(overhead.failedDisk), sizeof(int));
+    std::memcpy(buffer + sizeof(int) * 3, &magic, sizeof(int));
+    std::memcpy(buffer + sizeof(int) * 4, &(overhead.chunkSectors), sizeof(int));
+    writeSector(overhead.resyncSector, buffer, 5, 11);
+    std::memcpy(buffer + sizeof(int) * 6, &(overhead.bitmapSectors), sizeof(int));
+    std::memcpy(buffer + sizeof(int) * 7, &(overhead.regionSectors), sizeof(int));
+    writeSector(overhead.scrubSector, buffer, 8, 12);
+    std::memcpy(buffer + sizeof(int) * 9, &(overhead.allocSectors), sizeof(int));
+    std::memcpy(buffer + sizeof(int) * 10, &(overhead.logId), sizeof(int));
+    std::memcpy(buffer + sizeof(int) * 13, &(overhead.volumeId), sizeof(int));
+}
+
 #endif
@@ -1,10 +1,14 @@
 #ifndef TBLKDEV_H
 #define TBLKDEV_H
 
+// Sector numbers and counts of members and of the volume
+typedef long long TSector;
+
 constexpr int SECTOR_SIZE = 512;
 constexpr int MAX_RAID_DEVICES = 16;
-constexpr int MAX_DEVICE_SECTORS = 1024 * 1024 * 2;
+constexpr TSector MAX_DEVICE_SECTORS = (TSector) 1 << 40;
 constexpr int MIN_DEVICE_SECTORS = 1 * 1024 * 2;
+constexpr int MAX_CHUNK_SIZE = 1024 * 1024;
 
 constexpr int NO_DISK = -1;
 constexpr int RAID_STOPPED = 0;
@@ -14,11 +18,14 @@ constexpr int RAID_FAILED = 3;
 
 struct TBlkDev {
     int m_Devices;
-    int m_Sectors;
+    TSector m_Sectors;
+
+    int (*m_Read)(int, TSector, void *, int);
 
-    int (*m_Read)(int, int, void *, int);
+    int (*m_Write)(int, TSector, const void *, int);
 
-    int (*m_Write)(int, int, const void *, int);
+    // Optional: release sectors of a member, their content is undefined afterwards
+    int (*m_Discard)(int, TSector, TSector) = nullptr;
 };
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
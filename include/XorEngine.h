@@ -0,0 +1,39 @@
+#ifndef XORENGINE_H
+#define XORENGINE_H
+
+#include <cstddef>
+#include <cstring>
+
+// XOR kernels, the best supported one is selected by CPUID at startup
+constexpr int XOR_SCALAR = 0;
+constexpr int XOR_SSE2 = 1;
+constexpr int XOR_AVX2 = 2;
+constexpr int XOR_AVX512 = 3;
+constexpr int XOR_KERNELS = 4;
+
+// dst ^= src[0] ^ src[1] ^ ... ^ src[srcCnt - 1] in a single pass over 'len' bytes
+void xorBlocks(unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len);
+
+// Same as above with an explicitly chosen kernel, which must be supported
+void xorBlocks(int kernel, unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len);
+
+// Check whether the CPU supports a kernel
+bool xorSupported(int kernel);
+
+// Kernel selected at startup
+int xorKernel();
+
+const char *xorKernelName(int kernel);
+
+// dst = src[0] ^ src[1] ^ ... ^ src[srcCnt - 1], e.g. parity or reconstructed data
+inline void xorParity(unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    if (srcCnt == 0) {
+        std::memset(dst, 0, len);
+        return;
+    }
+    if (dst != src[0])
+        std::memcpy(dst, src[0], len);
+    xorBlocks(dst, src + 1, srcCnt - 1, len);
+}
+
+#endif
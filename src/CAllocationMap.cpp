@@ -0,0 +1,95 @@
+#include <algorithm>
+#include "../include/TBlkDev.h"
+#include "../include/CAllocationMap.h"
+
+using namespace std;
+
+constexpr TSector SECTOR_STRIPES = SECTOR_SIZE * 8;
+constexpr int SECTOR_WORDS = SECTOR_SIZE / 8;
+
+CAllocationMap::CAllocationMap(TSector stripes)
+        : words((size_t) ((stripes + 63) / 64)), dirty((size_t) ((stripes + SECTOR_STRIPES - 1) / SECTOR_STRIPES)),
+          stripeCnt(stripes), count(0), version(0) {}
+
+bool CAllocationMap::any(TSector first, TSector last) const {
+    for (TSector s = first; s < last; s++)
+        if (mapped(s))
+            return true;
+    return false;
+}
+
+vector<TSector> CAllocationMap::released(TSector first, TSector last) const {
+    vector<TSector> result;
+    for (TSector s = first; s < last; s++)
+        if (!mapped(s))
+            result.push_back(s);
+    return result;
+}
+
+long long CAllocationMap::map(const vector<TSector> &list) {
+    lock_guard<mutex> guard(lock);
+    bool changed = false;
+    for (TSector s : list) {
+        uint64_t bit = (uint64_t) 1 << s % 64;
+        if (!(words[s / 64].fetch_or(bit) & bit)) {
+            dirty[s / SECTOR_STRIPES] = true;
+            count++;
+            changed = true;
+        }
+    }
+    return changed ? ++version : version;
+}
+
+long long CAllocationMap::unmap(TSector first, TSector last) {
+    lock_guard<mutex> guard(lock);
+    bool changed = false;
+    for (TSector s = first; s < last; s++) {
+        uint64_t bit = (uint64_t) 1 << s % 64;
+        if (words[s / 64].fetch_and(~bit) & bit) {
+            dirty[s / SECTOR_STRIPES] = true;
+            count--;
+            changed = true;
+        }
+    }
+    return changed ? ++version : version;
+}
+
+long long CAllocationMap::touchAll() {
+    lock_guard<mutex> guard(lock);
+    fill(dirty.begin(), dirty.end(), true);
+    return ++version;
+}
+
+TSector CAllocationMap::mappedCount() const {
+    return count;
+}
+
+long long CAllocationMap::store(vector<int> &changed, vector<unsigned char> &sectors) {
+    lock_guard<mutex> guard(lock);
+    changed.clear();
+    sectors.clear();
+    for (size_t i = 0; i < dirty.size(); i++) {
+        if (!dirty[i])
+            continue;
+        dirty[i] = false;
+        changed.push_back((int) i);
+        size_t offset = sectors.size();
+        sectors.resize(offset + SECTOR_SIZE, 0);
+        for (size_t w = i * SECTOR_WORDS; w < min(words.size(), (i + 1) * SECTOR_WORDS); w++) {
+            uint64_t word = words[w].load(memory_order_relaxed);
+            for (int b = 0; b < 8; b++)
+                sectors[offset + (w - i * SECTOR_WORDS) * 8 + b] = (unsigned char) (word >> b * 8);
+        }
+    }
+    return version;
+}
+
+void CAllocationMap::load(const unsigned char *sectors, int sectorCnt) {
+    lock_guard<mutex> guard(lock);
+    TSector stripes = min(stripeCnt, sectorCnt * SECTOR_STRIPES);
+    for (TSector s = 0; s < stripes; s++) {
+        uint64_t bit = (uint64_t) 1 << s % 64;
+        if (sectors[s / 8] >> s % 8 & 1 && !(words[s / 64].fetch_or(bit) & bit))
+            count++;
+    }
+}
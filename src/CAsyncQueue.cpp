@@ -0,0 +1,131 @@
+#include <algorithm>
+#include "../include/CAsyncQueue.h"
+
+using namespace std;
+
+// Threads starting requests and running blocking ones; started requests do not hold a thread
+constexpr int MAX_ASYNC_WORKERS = 16;
+
+CAsyncQueue::CAsyncQueue(int depth) : depth(max(1, depth)), stopped(false), interrupted(false) {
+    for (int i = 0; i < min(this->depth, MAX_ASYNC_WORKERS); i++)
+        workers.emplace_back([this] { run(); });
+}
+
+CAsyncQueue::~CAsyncQueue() {
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this] { return requests.empty(); });
+        stopped = true;
+        changed.notify_all();
+    }
+    for (thread &worker : workers)
+        worker.join();
+}
+
+// Queue a request, it runs as soon as no earlier conflicting request is pending
+bool CAsyncQueue::submit(TSector firstStripe, TSector lastStripe, bool isWrite, Start start, Operation operation,
+                         Callback callback, unsigned long long tag) {
+    lock_guard<mutex> guard(lock);
+    if ((int) (requests.size() + completions.size()) >= depth)
+        return false;
+
+    bool blocking = !start;
+    requests.push_back({firstStripe, lastStripe, isWrite, REQUEST_WAITING, blocking, false, move(start),
+                        move(operation), move(callback), tag});
+    changed.notify_all();
+    return true;
+}
+
+int CAsyncQueue::reap(TRaidCompletion *out, int maxCnt, int minCnt) {
+    unique_lock<mutex> guard(lock);
+    minCnt = min(minCnt, maxCnt);
+    changed.wait(guard, [this, minCnt] {
+        if (interrupted || (int) completions.size() >= minCnt)
+            return true;
+        // Requests delivered to a callback never become completions
+        return none_of(requests.begin(), requests.end(), [](const Request &request) { return !request.callback; });
+    });
+
+    int cnt = 0;
+    for (; cnt < maxCnt && !completions.empty(); cnt++) {
+        out[cnt] = completions.front();
+        completions.pop_front();
+    }
+    if (cnt > 0)
+        changed.notify_all(); // slots freed for submit
+    return cnt;
+}
+
+void CAsyncQueue::interrupt() {
+    lock_guard<mutex> guard(lock);
+    interrupted = true;
+    changed.notify_all();
+}
+
+// A waiting request may run if it does not conflict with any earlier request
+bool CAsyncQueue::ready(list<Request>::iterator request) {
+    if (request->state != REQUEST_WAITING)
+        return false;
+    for (auto it = requests.begin(); it != request; ++it)
+        if ((it->isWrite || request->isWrite)
+            && it->firstStripe <= request->lastStripe && request->firstStripe <= it->lastStripe)
+            return false;
+    return true;
+}
+
+// Result of a started request, its completion is delivered by a worker
+void CAsyncQueue::finish(list<Request>::iterator request, bool success, bool retry) {
+    lock_guard<mutex> guard(lock);
+    if (retry) {
+        request->state = REQUEST_WAITING;
+        request->blocking = true;
+    } else {
+        request->state = REQUEST_FINISHED;
+        request->success = success;
+    }
+    changed.notify_all();
+}
+
+// Worker loop: deliver finished requests, start or run the oldest runnable request
+void CAsyncQueue::run() {
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        auto request = requests.end();
+        changed.wait(guard, [this, &request] {
+            for (request = requests.begin(); request != requests.end(); ++request)
+                if (request->state == REQUEST_FINISHED || ready(request))
+                    return true;
+            return stopped;
+        });
+        if (request == requests.end())
+            return;
+
+        if (request->state == REQUEST_WAITING) {
+            request->state = REQUEST_RUNNING;
+            bool blocking = request->blocking;
+            guard.unlock();
+
+            // A started request may finish on another thread before start() returns
+            if (!blocking && request->start([this, request](bool success, bool retry) {
+                finish(request, success, retry);
+            })) {
+                guard.lock();
+                continue;
+            }
+            bool success = request->operation();
+            guard.lock();
+            request->success = success;
+        }
+
+        request->state = REQUEST_DELIVERING;
+        guard.unlock();
+        if (request->callback)
+            request->callback(request->success);
+        guard.lock();
+
+        if (!request->callback)
+            completions.push_back({request->tag, request->success});
+        requests.erase(request);
+        changed.notify_all();
+    }
+}
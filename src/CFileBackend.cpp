@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../include/CFileBackend.h"
+
+using namespace std;
+
+// Buffer alignment for O_DIRECT, covers page and logical block size
+constexpr size_t DIRECT_ALIGN = 4096;
+
+// io_uring submission queue entries and bytes per submitted request
+constexpr unsigned URING_DEPTH = 32;
+constexpr size_t URING_SEGMENT = 64 * 1024;
+
+// Minimal io_uring on raw system calls: submit a batch, wait for all of it
+class CUring {
+public:
+    CUring() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED), sqRingSize(0), cqRingSize(0),
+               sqesSize(0) {}
+
+    ~CUring() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (ringFd >= 0)
+            ::close(ringFd);
+    }
+
+    // False if the kernel does not provide io_uring
+    bool init() {
+        io_uring_params params{};
+        ringFd = (int) syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+        if (ringFd < 0)
+            return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        cqRing = params.features & IORING_FEAT_SINGLE_MMAP
+                 ? sqRing
+                 : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (cqRing == MAP_FAILED || sqes == MAP_FAILED)
+            return false;
+
+        auto *sq = (unsigned char *) sqRing;
+        auto *cq = (unsigned char *) cqRing;
+        sqTail = (unsigned *) (sq + params.sq_off.tail);
+        sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *) (sq + params.sq_off.array);
+        cqHead = (unsigned *) (cq + params.cq_off.head);
+        cqTail = (unsigned *) (cq + params.cq_off.tail);
+        cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+        entries = params.sq_entries;
+        return true;
+    }
+
+    // Transfer 'len' bytes at 'offset' as requests of up to URING_SEGMENT bytes; the rest of a short
+    // request is submitted again with the next batch, like pread/pwrite are repeated
+    bool transfer(int fd, bool isWrite, unsigned char *data, size_t len, off_t offset) {
+        deque<Piece> queued;
+        for (size_t pos = 0; pos < len; pos += URING_SEGMENT)
+            queued.push_back({data + pos, min(URING_SEGMENT, len - pos), offset + (off_t) pos});
+        while (!queued.empty()) {
+            unsigned count = (unsigned) min<size_t>(entries, queued.size());
+            batch.assign(queued.begin(), queued.begin() + count);
+            queued.erase(queued.begin(), queued.begin() + count);
+            unsigned tail = *sqTail;
+            for (unsigned i = 0; i < count; i++) {
+                unsigned idx = tail & sqMask;
+                io_uring_sqe &sqe = ((io_uring_sqe *) sqes)[idx];
+                memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe.fd = fd;
+                sqe.addr = (uint64_t) (uintptr_t) batch[i].data;
+                sqe.len = (unsigned) batch[i].len;
+                sqe.off = (uint64_t) batch[i].offset;
+                sqe.user_data = i;
+                sqArray[idx] = idx;
+                tail++;
+            }
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+            // Submit the batch and wait until every request completed
+            bool valid = true;
+            unsigned submit = count;
+            for (unsigned done = 0; done < count;) {
+                int ret = (int) syscall(__NR_io_uring_enter, ringFd, submit, count - done, IORING_ENTER_GETEVENTS,
+                                        nullptr, 0);
+                if (ret < 0 && errno != EINTR) {
+                    // A failed call took no entries: withdraw the ones not taken, the caller may reuse
+                    // 'data' only once those in flight completed
+                    __atomic_store_n(sqTail, *sqTail - submit, __ATOMIC_RELEASE);
+                    drain(count - submit - done);
+                    return false;
+                }
+                if (ret > 0)
+                    submit -= min<unsigned>(submit, (unsigned) ret);
+                done += reap(valid, &queued);
+            }
+            if (!valid)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // Part of a transfer submitted as one request
+    struct Piece {
+        unsigned char *data;
+        size_t len;
+        off_t offset;
+    };
+
+    // Consume available completions of 'batch', 'valid' is cleared by a failed one or one that moved
+    // nothing; the rest of a short one goes to 'remainders'
+    unsigned reap(bool &valid, deque<Piece> *remainders) {
+        unsigned head = *cqHead;
+        unsigned ready = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned reaped = ready - head;
+        for (; head != ready; head++) {
+            const io_uring_cqe &cqe = cqes[head & cqMask];
+            const Piece &piece = batch[cqe.user_data];
+            if (cqe.res <= 0)
+                valid = false;
+            else if ((size_t) cqe.res < piece.len && remainders)
+                remainders->push_back({piece.data + cqe.res, piece.len - cqe.res, piece.offset + cqe.res});
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return reaped;
+    }
+
+    // Wait for 'inflight' requests taken by the kernel, so no stale completion is left for the next
+    // transfer; waiting is retried until they all arrive, the kernel completes every taken request
+    void drain(unsigned inflight) {
+        bool valid = true;
+        while (inflight > 0) {
+            int ret = (int) syscall(__NR_io_uring_enter, ringFd, 0, inflight, IORING_ENTER_GETEVENTS, nullptr, 0);
+            unsigned reaped = reap(valid, nullptr);
+            inflight -= min(inflight, reaped);
+            if (ret < 0 && errno != EINTR && !reaped)
+                sched_yield();
+        }
+    }
+
+    int ringFd;
+    void *sqRing;
+    void *cqRing;
+    void *sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+    unsigned entries;
+    vector<Piece> batch; // requests of the batch in flight, indexed by user_data
+};
+
+// One open member: descriptor, optional ring and bounce buffer for unaligned O_DIRECT transfers
+struct CFileBackend::Member {
+    int fd = -1;
+    mutex lock;
+    unique_ptr<CUring> ring;
+    unsigned char *bounce = nullptr;
+    size_t bounceSize = 0;
+
+    ~Member() {
+        free(bounce);
+        if (fd >= 0)
+            ::close(fd);
+    }
+};
+
+// Backend of each callback slot
+static CFileBackend *g_Backends[MAX_FILE_BACKENDS];
+static mutex g_SlotLock;
+
+template<int SLOT>
+int slotRead(int disk, TSector sector, void *data, int secCnt) {
+    return g_Backends[SLOT]->read(disk, sector, data, secCnt);
+}
+
+template<int SLOT>
+int slotWrite(int disk, TSector sector, const void *data, int secCnt) {
+    return g_Backends[SLOT]->write(disk, sector, data, secCnt);
+}
+
+template<int SLOT>
+int slotDiscard(int disk, TSector sector, TSector secCnt) {
+    return g_Backends[SLOT]->discard(disk, sector, secCnt);
+}
+
+// Point device callbacks at a slot
+template<int SLOT>
+void bindSlot(int slot, TBlkDev &dev) {
+    if (slot == SLOT) {
+        dev.m_Read = slotRead<SLOT>;
+        dev.m_Write = slotWrite<SLOT>;
+        dev.m_Discard = slotDiscard<SLOT>;
+    } else
+        bindSlot<SLOT + 1>(slot, dev);
+}
+
+template<>
+void bindSlot<MAX_FILE_BACKENDS>(int, TBlkDev &) {}
+
+// Size of a file or block device in sectors, -1 on error
+static TSector memberSectors(int fd) {
+    struct stat info{};
+    if (fstat(fd, &info) != 0)
+        return -1;
+    if (S_ISBLK(info.st_mode)) {
+        unsigned long long bytes = 0;
+        return ioctl(fd, BLKGETSIZE64, &bytes) == 0 ? (TSector) (bytes / SECTOR_SIZE) : -1;
+    }
+    return info.st_size / SECTOR_SIZE;
+}
+
+// Offset and length alignment O_DIRECT requires of a member, 0 if unknown
+static size_t directAlignment(int fd) {
+    struct stat info{};
+    if (fstat(fd, &info) != 0)
+        return 0;
+    if (S_ISBLK(info.st_mode)) {
+        int blockSize = 0;
+        return ioctl(fd, BLKSSZGET, &blockSize) == 0 && blockSize > 0 ? (size_t) blockSize : 0;
+    }
+#ifdef STATX_DIOALIGN
+    struct statx attributes{};
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &attributes) == 0 && (attributes.stx_mask & STATX_DIOALIGN)
+        && attributes.stx_dio_mem_align <= DIRECT_ALIGN)
+        return attributes.stx_dio_offset_align;
+#endif
+    return 0;
+}
+
+CFileBackend::CFileBackend() : sectors(0), activeFlags(0), slot(-1) {}
+
+CFileBackend::~CFileBackend() {
+    close();
+}
+
+bool CFileBackend::open(const vector<string> &paths, TSector sectors, int flags) {
+    close();
+    if (paths.size() < 3 || paths.size() > (size_t) MAX_RAID_DEVICES || sectors < 0)
+        return false;
+
+    {
+        lock_guard<mutex> guard(g_SlotLock);
+        for (int i = 0; i < MAX_FILE_BACKENDS && slot < 0; i++)
+            if (!g_Backends[i]) {
+                g_Backends[i] = this;
+                slot = i;
+            }
+    }
+    if (slot < 0)
+        return false;
+
+    activeFlags = flags;
+    TSector smallest = -1;
+    for (const string &path : paths) {
+        members.emplace_back(new Member);
+        Member &member = *members.back();
+
+        // File systems without O_DIRECT reject it with EINVAL
+        if (activeFlags & BACKEND_DIRECT) {
+            member.fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
+            if (member.fd < 0 && errno == EINVAL)
+                activeFlags &= ~BACKEND_DIRECT;
+        }
+        if (member.fd < 0)
+            member.fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (member.fd < 0) {
+            close();
+            return false;
+        }
+
+        // Transfers are aligned to sectors only, members with larger or unknown blocks run buffered
+        size_t alignment = (activeFlags & BACKEND_DIRECT) ? directAlignment(member.fd) : 0;
+        if (!alignment || SECTOR_SIZE % alignment != 0)
+            activeFlags &= ~BACKEND_DIRECT;
+
+        TSector size = memberSectors(member.fd);
+        if (sectors && size < sectors && ftruncate(member.fd, (off_t) sectors * SECTOR_SIZE) == 0)
+            size = sectors;
+        if (size < 0 || (sectors && size < sectors)) {
+            close();
+            return false;
+        }
+        smallest = smallest < 0 ? size : min(smallest, size);
+    }
+    this->sectors = sectors ? sectors : min(smallest, MAX_DEVICE_SECTORS);
+
+    // Members fall back together, those opened with O_DIRECT before one could not use it drop it
+    if (!(activeFlags & BACKEND_DIRECT))
+        for (auto &member : members) {
+            int mode = fcntl(member->fd, F_GETFL);
+            if (mode < 0 || ((mode & O_DIRECT) && fcntl(member->fd, F_SETFL, mode & ~O_DIRECT) != 0)) {
+                close();
+                return false;
+            }
+        }
+
+    // One ring per member, all members fall back together; a first read checks the kernel has the opcodes
+    void *probe = nullptr;
+    if ((activeFlags & BACKEND_URING) && posix_memalign(&probe, DIRECT_ALIGN, SECTOR_SIZE) != 0)
+        activeFlags &= ~BACKEND_URING;
+    for (auto &member : members)
+        if (activeFlags & BACKEND_URING) {
+            member->ring.reset(new CUring);
+            if (!member->ring->init() || !member->ring->transfer(member->fd, false, (unsigned char *) probe, SECTOR_SIZE, 0))
+                activeFlags &= ~BACKEND_URING;
+        }
+    free(probe);
+    if (!(activeFlags & BACKEND_URING))
+        for (auto &member : members)
+            member->ring.reset();
+
+    return true;
+}
+
+void CFileBackend::close() {
+    members.clear();
+    sectors = 0;
+    if (slot >= 0) {
+        lock_guard<mutex> guard(g_SlotLock);
+        g_Backends[slot] = nullptr;
+        slot = -1;
+    }
+}
+
+TBlkDev CFileBackend::device() const {
+    TBlkDev dev{(int) members.size(), sectors, nullptr, nullptr};
+    bindSlot<0>(slot, dev);
+    return dev;
+}
+
+int CFileBackend::flags() const {
+    return activeFlags;
+}
+
+int CFileBackend::read(int disk, TSector sector, void *data, int secCnt) {
+    return transfer(disk, sector, (unsigned char *) data, secCnt, false);
+}
+
+int CFileBackend::write(int disk, TSector sector, const void *data, int secCnt) {
+    return transfer(disk, sector, (unsigned char *) data, secCnt, true);
+}
+
+// Block devices discard the range, files punch a hole; returns 1 if the member released it
+int CFileBackend::discard(int disk, TSector sector, TSector secCnt) {
+    if (disk < 0 || disk >= (int) members.size() || sector < 0 || secCnt <= 0 || sector + secCnt > sectors)
+        return 0;
+
+    int fd = members[disk]->fd;
+    struct stat info{};
+    if (fstat(fd, &info) != 0)
+        return 0;
+    if (S_ISBLK(info.st_mode)) {
+        uint64_t range[2] = {(uint64_t) sector * SECTOR_SIZE, (uint64_t) secCnt * SECTOR_SIZE};
+        return ioctl(fd, BLKDISCARD, range) == 0;
+    }
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) sector * SECTOR_SIZE,
+                     (off_t) secCnt * SECTOR_SIZE) == 0;
+}
+
+// Transfer whole sectors, returns 'secCnt' on success and 0 on failure
+int CFileBackend::transfer(int disk, TSector sector, unsigned char *data, int secCnt, bool isWrite) {
+    if (disk < 0 || disk >= (int) members.size() || sector < 0 || secCnt <= 0 || sector + secCnt > sectors)
+        return 0;
+
+    Member &member = *members[disk];
+    lock_guard<mutex> guard(member.lock);
+    size_t len = (size_t) secCnt * SECTOR_SIZE;
+    off_t offset = (off_t) sector * SECTOR_SIZE;
+
+    // O_DIRECT needs aligned memory
+    unsigned char *buffer = data;
+    if ((activeFlags & BACKEND_DIRECT) && (uintptr_t) data % DIRECT_ALIGN != 0) {
+        if (member.bounceSize < len) {
+            free(member.bounce);
+            member.bounce = nullptr;
+            member.bounceSize = 0;
+            void *aligned;
+            if (posix_memalign(&aligned, DIRECT_ALIGN, len) != 0)
+                return 0;
+            member.bounce = (unsigned char *) aligned;
+            member.bounceSize = len;
+        }
+        buffer = member.bounce;
+        if (isWrite)
+            memcpy(buffer, data, len);
+    }
+
+    bool valid = true;
+    if (member.ring)
+        valid = member.ring->transfer(member.fd, isWrite, buffer, len, offset);
+    else
+        for (size_t done = 0; done < len && valid;) {
+            ssize_t ret = isWrite ? pwrite(member.fd, buffer + done, len - done, offset + done)
+                                  : pread(member.fd, buffer + done, len - done, offset + done);
+            if (ret > 0)
+                done += ret;
+            else if (ret == 0 || errno != EINTR)
+                valid = false;
+        }
+
+    if (!valid)
+        return 0;
+    if (!isWrite && buffer != data)
+        memcpy(data, buffer, len);
+    return secCnt;
+}
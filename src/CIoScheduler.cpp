@@ -0,0 +1,156 @@
+#include <algorithm>
+#include "../include/CIoScheduler.h"
+
+using namespace std;
+
+// Nanoseconds of a steady clock time, for atomics
+static long long sinceEpoch(CIoScheduler::Clock::time_point time) {
+    return chrono::duration_cast<chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+// Start a worker for each disk, buckets start full
+CIoScheduler::CIoScheduler(int disks, const TIoClassConfig *config, chrono::microseconds idleThreshold)
+        : lastForeground(0), idleThreshold(chrono::duration_cast<chrono::nanoseconds>(idleThreshold).count()) {
+    Clock::time_point now = Clock::now();
+    for (int c = 0; c < IO_CLASSES; c++) {
+        buckets[c] = {config[c], 0, now};
+        buckets[c].tokens = (double) (config[c].burst ? config[c].burst : config[c].rate);
+        deadlines[c] = config[c].deadlineUs;
+    }
+    for (int i = 0; i < disks; i++) {
+        queues.emplace_back(new Queue);
+        Queue &queue = *queues.back();
+        queue.worker = thread([this, &queue] { run(queue); });
+    }
+}
+
+CIoScheduler::~CIoScheduler() {
+    for (auto &queue : queues) {
+        lock_guard<mutex> guard(queue->lock);
+        queue->stopped = true;
+        queue->cv.notify_one();
+    }
+    for (auto &queue : queues)
+        queue->worker.join();
+}
+
+void CIoScheduler::submit(int disk, int ioClass, size_t bytes, Task task) {
+    Clock::time_point now = Clock::now();
+    if (ioClass == IO_FOREGROUND)
+        lastForeground = sinceEpoch(now);
+
+    Queue &queue = *queues[disk];
+    lock_guard<mutex> guard(queue.lock);
+    queue.tasks[ioClass].push_back({move(task), bytes, now});
+    queue.cv.notify_one();
+}
+
+// New limits apply to the next dispatch, the bucket keeps its level up to the new burst
+void CIoScheduler::configure(int ioClass, const TIoClassConfig &config) {
+    {
+        lock_guard<mutex> guard(bucketLock);
+        Bucket &bucket = buckets[ioClass];
+        bucket.config = config;
+        bucket.tokens = min(bucket.tokens, (double) (config.burst ? config.burst : config.rate));
+        deadlines[ioClass] = config.deadlineUs;
+    }
+    wakeAll();
+}
+
+void CIoScheduler::setIdleThreshold(chrono::microseconds threshold) {
+    idleThreshold = chrono::duration_cast<chrono::nanoseconds>(threshold).count();
+    wakeAll();
+}
+
+bool CIoScheduler::idle() const {
+    return idle(Clock::now());
+}
+
+bool CIoScheduler::idle(Clock::time_point now) const {
+    return sinceEpoch(now) - lastForeground.load() > idleThreshold.load();
+}
+
+// Charge 'bytes' to the bucket of a class. Without enough tokens, unless 'force', false and
+// 'retry' is when to try again. A bucket with tokens left may go into debt for a large I/O.
+bool CIoScheduler::take(int ioClass, size_t bytes, Clock::time_point now, bool force, Clock::time_point &retry) {
+    lock_guard<mutex> guard(bucketLock);
+    Bucket &bucket = buckets[ioClass];
+    const TIoClassConfig &config = bucket.config;
+    if (!config.rate || (ioClass != IO_FOREGROUND && idle(now)))
+        return true;
+
+    double burst = (double) (config.burst ? config.burst : config.rate);
+    double elapsed = chrono::duration<double>(now - bucket.refilled).count();
+    bucket.tokens = min(burst, bucket.tokens + elapsed * config.rate);
+    bucket.refilled = now;
+    if (bucket.tokens > 0 || force) {
+        bucket.tokens -= (double) bytes;
+        return true;
+    }
+
+    retry = now + chrono::duration_cast<Clock::duration>(chrono::duration<double>((1 - bucket.tokens) / config.rate));
+    // Clients going quiet lifts the limit of background classes
+    if (ioClass != IO_FOREGROUND)
+        retry = min(retry, Clock::time_point(chrono::nanoseconds(lastForeground.load() + idleThreshold.load() + 1)));
+    return false;
+}
+
+// Throttled workers re-evaluate their queues
+void CIoScheduler::wakeAll() {
+    for (auto &queue : queues) {
+        lock_guard<mutex> guard(queue->lock);
+        queue->cv.notify_one();
+    }
+}
+
+// Worker loop: dispatch the most urgent I/O its bucket allows, sleep while everything queued is throttled
+void CIoScheduler::run(Queue &queue) {
+    unique_lock<mutex> guard(queue.lock);
+    for (;;) {
+        Clock::time_point now = Clock::now();
+        Clock::time_point wake = Clock::time_point::max();
+        Clock::time_point due[IO_CLASSES];
+        int order[IO_CLASSES];
+        int queued = 0;
+
+        // Overdue I/O first, the one due earliest, then the rest by priority
+        for (int c = 0; c < IO_CLASSES; c++) {
+            if (queue.tasks[c].empty())
+                continue;
+            int deadline = deadlines[c].load();
+            due[c] = deadline ? queue.tasks[c].front().queued + chrono::microseconds(deadline) : Clock::time_point::max();
+            if (due[c] > now)
+                wake = min(wake, due[c]);
+            order[queued++] = c;
+        }
+        if (!queued) {
+            if (queue.stopped)
+                return;
+            queue.cv.wait(guard);
+            continue;
+        }
+        stable_sort(order, order + queued, [&](int a, int b) { return min(due[a], now) < min(due[b], now); });
+
+        // Shutting down drains the queues regardless of limits
+        int pick = -1;
+        Clock::time_point retry;
+        for (int i = 0; i < queued && pick < 0; i++) {
+            int c = order[i];
+            if (take(c, queue.tasks[c].front().bytes, now, queue.stopped, retry))
+                pick = c;
+            else
+                wake = min(wake, retry);
+        }
+        if (pick < 0) {
+            queue.cv.wait_until(guard, wake);
+            continue;
+        }
+
+        Queued task = move(queue.tasks[pick].front());
+        queue.tasks[pick].pop_front();
+        Clock::duration wait = now - task.queued;
+        guard.unlock();
+        task.run(wait, due[pick] < now);
+        guard.lock();
+    }
+}
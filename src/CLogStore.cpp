@@ -0,0 +1,827 @@
+#include <algorithm>
+#include <cstring>
+#include "../include/TBlkDev.h"
+#include "../include/CLogStore.h"
+
+using namespace std;
+
+// Segment size aimed for, rounded up to whole stripes
+constexpr int LOG_SEGMENT_SECTORS = 512;
+
+// Segments kept out of the logical size: open, being written, cleaned and waiting, spare
+constexpr int LOG_RESERVE_SEGMENTS = 4;
+
+// Share of the remaining slots exposed as logical sectors, the rest keeps cleaning cheap
+constexpr int LOG_FILL_PERCENT = 85;
+
+// Free segments the write path keeps, cleaning whatever it takes
+constexpr size_t CLEAN_RESERVE = 2;
+
+// Idle open segment written after this long, background cleaning checked as often
+constexpr auto FLUSH_INTERVAL = chrono::milliseconds(1000);
+
+// Summary: magic, log id, sequence, fill, checksum, then 64-bit logical sector and checksum of each slot
+constexpr int LOG_MAGIC = 0x52354c47;
+constexpr int SUMMARY_HEADER = 24;
+constexpr int SUMMARY_ENTRY = 12;
+
+// Map and table pages: log id and checksum, then 64-bit addresses of logical sectors, or live sectors + 1
+// of segments with 0 for free ones
+constexpr int PAGE_HEADER = 8;
+constexpr int MAP_ENTRIES = (SECTOR_SIZE - PAGE_HEADER) / (int) sizeof(TSector);
+constexpr int TABLE_ENTRIES = (SECTOR_SIZE - PAGE_HEADER) / (int) sizeof(int);
+
+// Checkpoint record: magic, log id, number, sequence of the last segment covered, count, checksum, then
+// the segments opened next in this order
+constexpr int RECORD_MAGIC = 0x50434c47;
+constexpr int RECORD_HEADER = 32;
+constexpr int RECORD_ENTRIES = (SECTOR_SIZE - RECORD_HEADER) / (int) sizeof(TSector);
+
+// Map pages a request pins at once
+constexpr int PIN_PAGES = 64;
+
+// Fewest map pages cached
+constexpr size_t MIN_MAP_PAGES = 4;
+
+// FNV-1a
+static unsigned checksum(const unsigned char *data, size_t length) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+// Tag a map or table page with the log id and its checksum
+static void stamp(unsigned char *page, unsigned logId) {
+    unsigned sum = checksum(page + PAGE_HEADER, SECTOR_SIZE - PAGE_HEADER);
+    memcpy(page, &logId, sizeof(unsigned));
+    memcpy(page + 4, &sum, sizeof(unsigned));
+}
+
+// A page written by this log, anything else reads as never written
+static bool stamped(const unsigned char *page, unsigned logId) {
+    unsigned id, sum;
+    memcpy(&id, page, sizeof(unsigned));
+    memcpy(&sum, page + 4, sizeof(unsigned));
+    return id == logId && sum == checksum(page + PAGE_HEADER, SECTOR_SIZE - PAGE_HEADER);
+}
+
+// Map pages holding logical sectors 'first' to 'last'
+static vector<TSector> pageRange(TSector first, TSector last) {
+    vector<TSector> pageNrs;
+    for (TSector pageNr = first / MAP_ENTRIES; pageNr <= last / MAP_ENTRIES; pageNr++)
+        pageNrs.push_back(pageNr);
+    return pageNrs;
+}
+
+// Map pages holding the valid ones of 'count' logical sectors
+static vector<TSector> pagesOf(const TSector *secNrs, int count, TSector logical) {
+    vector<TSector> pageNrs;
+    for (int i = 0; i < count; i++)
+        if (secNrs[i] >= 0 && secNrs[i] < logical)
+            pageNrs.push_back(secNrs[i] / MAP_ENTRIES);
+    sort(pageNrs.begin(), pageNrs.end());
+    pageNrs.erase(unique(pageNrs.begin(), pageNrs.end()), pageNrs.end());
+    return pageNrs;
+}
+
+// Write sector images of sorted page numbers from 'base', adjacent pages with one call
+static bool storeRuns(const CLogStore::Store &store, TSector base, const vector<TSector> &pageNrs,
+                      const unsigned char *images) {
+    for (size_t first = 0, last; first < pageNrs.size(); first = last) {
+        for (last = first + 1; last < pageNrs.size() && pageNrs[last] == pageNrs[last - 1] + 1; last++);
+        if (!store(base + pageNrs[first], images + first * SECTOR_SIZE, (int) (last - first)))
+            return false;
+    }
+    return true;
+}
+
+// Map and table pages behind the segments, then the two checkpoint records
+static TSector metadataSectors(TSector logical, TSector segments) {
+    return (logical + MAP_ENTRIES - 1) / MAP_ENTRIES + (segments + TABLE_ENTRIES - 1) / TABLE_ENTRIES + 2;
+}
+
+void CLogStore::geometry(TSector rawSectors, int stripeSectors, int &segmentSectors, int &summarySectors,
+                         TSector &segments, TSector &logical) {
+    segmentSectors = (LOG_SEGMENT_SECTORS + stripeSectors - 1) / stripeSectors * stripeSectors;
+    summarySectors = (SUMMARY_HEADER + SUMMARY_ENTRY * segmentSectors + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int slots = segmentSectors - summarySectors;
+
+    // Estimated from the metadata each segment adds, then lowered until it fits
+    double perSegment = segmentSectors + (double) slots * LOG_FILL_PERCENT / 100 / MAP_ENTRIES + 1.0 / TABLE_ENTRIES;
+    segments = min(rawSectors / segmentSectors, (TSector) (rawSectors / perSegment) + 1);
+    for (; segments > LOG_RESERVE_SEGMENTS; segments--) {
+        logical = (segments - LOG_RESERVE_SEGMENTS) * slots * LOG_FILL_PERCENT / 100;
+        if (segments * segmentSectors + metadataSectors(logical, segments) <= rawSectors)
+            return;
+    }
+    logical = 0;
+}
+
+TSector CLogStore::logicalSize(TSector rawSectors, int stripeSectors) {
+    int segmentSectors, summarySectors;
+    TSector segments, logical;
+    geometry(rawSectors, stripeSectors, segmentSectors, summarySectors, segments, logical);
+    return logical;
+}
+
+CLogStore::CLogStore(TSector rawSectors, int stripeSectors, unsigned logId, size_t mapCache, Fetch fetch, Store store)
+        : logId(logId), mapCapacity(max(mapCache / SECTOR_SIZE, MIN_MAP_PAGES)), fetch(move(fetch)),
+          store(move(store)), dirtyPages(0), dirtyTables(0), freeCount(0), scanFrom(0), sequence(1), sealed(0),
+          written(0), checkpointSealed(0), checkpointNumber(0), recordSlot(0), broken(false), openSegment(-1),
+          openFill(0), sealedSegment(-1), counters(), stopping(false) {
+    geometry(rawSectors, stripeSectors, segmentSectors, summarySectors, segments, logical);
+    slots = segmentSectors - summarySectors;
+    mapStart = segments * segmentSectors;
+    tableStart = mapStart + (logical + MAP_ENTRIES - 1) / MAP_ENTRIES;
+    recordStart = tableStart + (segments + TABLE_ENTRIES - 1) / TABLE_ENTRIES;
+    mapStored.assign((size_t) (tableStart - mapStart), true);
+    live.assign((size_t) segments, 0);
+    state.assign((size_t) segments, SEGMENT_FREE);
+    tableDirty.assign((size_t) (recordStart - tableStart), false);
+    openData.resize((size_t) segmentSectors * SECTOR_SIZE);
+    openLogicals.assign((size_t) slots, -1);
+    sealedData.resize((size_t) segmentSectors * SECTOR_SIZE);
+    counters.segments = segments;
+}
+
+CLogStore::~CLogStore() {
+    stopFlusher();
+}
+
+// The newer valid record gives the segment table and the segments opened after it. Those that carry the
+// next sequences were written since and are replayed on top of the map; only the newest may have been
+// torn by a crash, its torn sectors keep their previous copy. A fresh log gets its first record here.
+bool CLogStore::recover() {
+    lock_guard<mutex> writing(writeLock);
+    TSector tablePages = recordStart - tableStart;
+    vector<unsigned char> records(2 * SECTOR_SIZE);
+    vector<unsigned char> table((size_t) tablePages * SECTOR_SIZE);
+    if (!fetch(recordStart, records.data(), 2) || !fetch(tableStart, table.data(), (int) tablePages))
+        return false;
+
+    bool fresh = true;
+    long long last = 0;
+    vector<TSector> listed;
+    for (int slot = 0; slot < 2; slot++) {
+        long long number, seq;
+        vector<TSector> segmentNrs;
+        if (parseRecord(&records[(size_t) slot * SECTOR_SIZE], number, seq, segmentNrs)
+            && (fresh || number > checkpointNumber)) {
+            fresh = false;
+            checkpointNumber = number;
+            last = seq;
+            listed.swap(segmentNrs);
+            recordSlot = 1 - slot;
+        }
+    }
+
+    vector<unsigned char> summary((size_t) summarySectors * SECTOR_SIZE);
+    vector<TSector> logicals;
+    vector<unsigned> sums;
+    size_t replayed = 0;
+    for (; replayed < listed.size(); replayed++) {
+        long long seq;
+        logicals.resize((replayed + 1) * slots);
+        sums.resize((replayed + 1) * slots);
+        if (!fetch(listed[replayed] * segmentSectors, summary.data(), summarySectors))
+            return false;
+        if (!parse(summary.data(), seq, &logicals[replayed * slots], &sums[replayed * slots])
+            || seq != last + 1 + (long long) replayed)
+            break;
+    }
+    if (replayed) {
+        TSector newest = listed[replayed - 1];
+        if (!fetch(newest * segmentSectors + summarySectors, sealedData.data(), slots))
+            return false;
+        for (int slot = 0; slot < slots; slot++) {
+            size_t at = (replayed - 1) * slots + slot;
+            if (logicals[at] >= 0 && checksum(&sealedData[(size_t) slot * SECTOR_SIZE], SECTOR_SIZE) != sums[at])
+                logicals[at] = -1;
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        fill(mapStored.begin(), mapStored.end(), !fresh);
+        vector<bool> tableValid((size_t) tablePages);
+        for (TSector tablePage = 0; tablePage < tablePages; tablePage++)
+            tableValid[tablePage] = !fresh && stamped(&table[(size_t) tablePage * SECTOR_SIZE], logId);
+        for (TSector segment = 0; segment < segments; segment++) {
+            const unsigned char *page = &table[(size_t) (segment / TABLE_ENTRIES) * SECTOR_SIZE];
+            int value = 0;
+            if (tableValid[segment / TABLE_ENTRIES])
+                memcpy(&value, page + PAGE_HEADER + segment % TABLE_ENTRIES * sizeof(int), sizeof(int));
+            state[segment] = value > 0 ? SEGMENT_USED : SEGMENT_FREE;
+            live[segment] = max(value - 1, 0);
+        }
+    }
+
+    for (size_t k = 0; k < replayed; k++) {
+        TSector segment = listed[k];
+        vector<TSector> pageNrs = pagesOf(&logicals[k * slots], slots, logical);
+        if (!pin(pageNrs))
+            return false;
+        {
+            lock_guard<mutex> guard(lock);
+            state[segment] = SEGMENT_USED;
+            live[segment] = 0;
+            changed(segment);
+            for (int slot = 0; slot < slots; slot++) {
+                TSector secNr = logicals[k * slots + slot];
+                if (secNr < 0 || secNr >= logical)
+                    continue;
+                release(lookup(secNr));
+                remap(secNr, segment * slots + slot);
+                live[segment]++;
+            }
+        }
+        unpin(pageNrs);
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        sequence = last + 1 + (long long) replayed;
+        nextSegments.assign(listed.begin() + replayed, listed.end());
+        for (TSector segment : nextSegments)
+            state[segment] = SEGMENT_FREE;
+        freeCount = (TSector) count(state.begin(), state.end(), SEGMENT_FREE);
+        counters.replayedSegments = (TSector) replayed;
+        if (!fresh && !replayed) {
+            openNext();
+            return openSegment >= 0;
+        }
+    }
+    return seal(false, true);
+}
+
+// Unwritten sectors read as zeros, the open and the sealed segment from memory
+bool CLogStore::read(TSector secNr, int secCnt, const Sector &sector) {
+    if (secNr < 0 || secCnt < 0 || secNr + secCnt > logical)
+        return false;
+
+    shared_lock<shared_timed_mutex> reading(readers);
+    vector<pair<TSector, int>> located; // RAID sector, request sector
+    for (int done = 0; done < secCnt;) {
+        int chunk = min(secCnt - done, PIN_PAGES * MAP_ENTRIES);
+        vector<TSector> pageNrs = pageRange(secNr + done, secNr + done + chunk - 1);
+        if (!pin(pageNrs))
+            return false;
+        {
+            lock_guard<mutex> guard(lock);
+            for (int i = done; i < done + chunk; i++) {
+                TSector address = lookup(secNr + i);
+                TSector segment = address / slots;
+                int slot = (int) (address - segment * slots);
+                if (address < 0)
+                    memset(sector(i), 0, SECTOR_SIZE);
+                else if (segment == openSegment)
+                    memcpy(sector(i), &openData[(size_t) (summarySectors + slot) * SECTOR_SIZE], SECTOR_SIZE);
+                else if (segment == sealedSegment)
+                    memcpy(sector(i), &sealedData[(size_t) (summarySectors + slot) * SECTOR_SIZE], SECTOR_SIZE);
+                else
+                    located.emplace_back(segment * segmentSectors + summarySectors + slot, i);
+            }
+        }
+        unpin(pageNrs);
+        done += chunk;
+    }
+
+    // Sectors written together are read with one call
+    vector<unsigned char> buffer;
+    for (size_t first = 0, last; first < located.size(); first = last) {
+        for (last = first + 1; last < located.size() && located[last].first == located[last - 1].first + 1; last++);
+        int count = (int) (last - first);
+        buffer.resize((size_t) count * SECTOR_SIZE);
+        if (!fetch(located[first].first, buffer.data(), count))
+            return false;
+        for (int k = 0; k < count; k++)
+            memcpy(sector(located[first + k].second), &buffer[(size_t) k * SECTOR_SIZE], SECTOR_SIZE);
+    }
+    return true;
+}
+
+// Append to the open segment; a full one is written and space reclaimed before appending goes on
+bool CLogStore::write(TSector secNr, int secCnt, const Sector &sector) {
+    if (secNr < 0 || secCnt < 0 || secNr + secCnt > logical)
+        return false;
+
+    for (int done = 0; done < secCnt;) {
+        int chunk = min(secCnt - done, PIN_PAGES * MAP_ENTRIES);
+        vector<TSector> pageNrs = pageRange(secNr + done, secNr + done + chunk - 1);
+        if (!pin(pageNrs))
+            return false;
+        bool valid = true;
+        for (int i = done; valid && i < done + chunk;) {
+            {
+                lock_guard<mutex> guard(lock);
+                lastWrite = chrono::steady_clock::now();
+                for (; i < done + chunk && openSegment >= 0 && openFill < slots; i++)
+                    place(secNr + i, sector(i));
+                if (i == done + chunk)
+                    break;
+            }
+            lock_guard<mutex> writing(writeLock);
+            valid = seal(true) && clean(CLEAN_RESERVE, slots - 1);
+        }
+        unpin(pageNrs);
+        if (!valid)
+            return false;
+        done += chunk;
+    }
+    return true;
+}
+
+bool CLogStore::flush() {
+    lock_guard<mutex> writing(writeLock);
+    return seal(false) && clean(CLEAN_RESERVE, slots - 1) && seal(false, true);
+}
+
+TLogStats CLogStore::stats() const {
+    lock_guard<mutex> guard(lock);
+    TLogStats snapshot = counters;
+    snapshot.freeSegments = freeCount;
+    snapshot.cachedMapPages = (TSector) pages.size();
+    return snapshot;
+}
+
+void CLogStore::startFlusher() {
+    stopping = false;
+    size_t ahead = max(CLEAN_RESERVE + 1, (size_t) segments / 16);
+    flusher = thread([this, ahead] {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, FLUSH_INTERVAL, [this] { return stopping; });
+            if (stopping)
+                break;
+            bool idle = openFill && chrono::steady_clock::now() - lastWrite >= FLUSH_INTERVAL;
+            if (!idle && (size_t) freeCount >= ahead)
+                continue;
+            guard.unlock();
+            {
+                // Background cleaning only takes segments that are mostly stale
+                lock_guard<mutex> writing(writeLock);
+                if (!idle || seal(false, true))
+                    clean(ahead, slots / 2);
+            }
+            guard.lock();
+        }
+    });
+}
+
+void CLogStore::stopFlusher() {
+    if (!flusher.joinable())
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        wake.notify_one();
+    }
+    flusher.join();
+}
+
+// Cache the sorted map pages 'pageNrs' until unpin(); pages missing are loaded outside the lock while
+// others needing them wait. False if one cannot be read.
+bool CLogStore::pin(const vector<TSector> &pageNrs) {
+    unique_lock<mutex> guard(lock);
+    vector<TSector> missing;
+    for (TSector pageNr : pageNrs) {
+        auto found = pages.find(pageNr);
+        if (found == pages.end()) {
+            found = pages.emplace(pageNr, MapPage()).first;
+            found->second.recent = recentPages.insert(recentPages.begin(), pageNr);
+            if (mapStored[pageNr]) {
+                found->second.loading = true;
+                missing.push_back(pageNr);
+            } else
+                found->second.entries.assign(MAP_ENTRIES, -1);
+        } else
+            recentPages.splice(recentPages.begin(), recentPages, found->second.recent);
+        found->second.pins++;
+    }
+
+    if (!missing.empty()) {
+        guard.unlock();
+        vector<unsigned char> images(missing.size() * SECTOR_SIZE);
+        vector<bool> read(missing.size());
+        for (size_t first = 0, last; first < missing.size(); first = last) {
+            for (last = first + 1; last < missing.size() && missing[last] == missing[last - 1] + 1; last++);
+            bool valid = fetch(mapStart + missing[first], &images[first * SECTOR_SIZE], (int) (last - first));
+            fill(read.begin() + first, read.begin() + last, valid);
+        }
+        guard.lock();
+        for (size_t k = 0; k < missing.size(); k++) {
+            MapPage &page = pages.at(missing[k]);
+            page.loading = false;
+            if (!read[k])
+                continue;
+            page.entries.assign(MAP_ENTRIES, -1);
+            if (stamped(&images[k * SECTOR_SIZE], logId))
+                memcpy(page.entries.data(), &images[k * SECTOR_SIZE + PAGE_HEADER], MAP_ENTRIES * sizeof(TSector));
+        }
+        loaded.notify_all();
+    }
+    loaded.wait(guard, [this, &pageNrs] {
+        return none_of(pageNrs.begin(), pageNrs.end(), [this](TSector pageNr) { return pages.at(pageNr).loading; });
+    });
+    bool valid = all_of(pageNrs.begin(), pageNrs.end(),
+                        [this](TSector pageNr) { return !pages.at(pageNr).entries.empty(); });
+    guard.unlock();
+    if (!valid)
+        unpin(pageNrs);
+    return valid;
+}
+
+// Pages that failed to load are dropped once nothing pins them
+void CLogStore::unpin(const vector<TSector> &pageNrs) {
+    lock_guard<mutex> guard(lock);
+    for (TSector pageNr : pageNrs) {
+        auto found = pages.find(pageNr);
+        if (--found->second.pins == 0 && found->second.entries.empty() && !found->second.loading) {
+            recentPages.erase(found->second.recent);
+            pages.erase(found);
+        }
+    }
+    evict();
+}
+
+// Drop the least recently used pages over capacity; dirty pages stay until a checkpoint writes them
+void CLogStore::evict() {
+    for (auto it = recentPages.end(); pages.size() > mapCapacity && it != recentPages.begin();) {
+        auto found = pages.find(*--it);
+        if (found->second.pins || found->second.dirty)
+            continue;
+        it = recentPages.erase(it);
+        pages.erase(found);
+    }
+}
+
+// Map entries of pinned pages
+TSector CLogStore::lookup(TSector secNr) const {
+    return pages.at(secNr / MAP_ENTRIES).entries[(size_t) (secNr % MAP_ENTRIES)];
+}
+
+void CLogStore::remap(TSector secNr, TSector address) {
+    MapPage &page = pages.at(secNr / MAP_ENTRIES);
+    page.entries[(size_t) (secNr % MAP_ENTRIES)] = address;
+    page.version++;
+    if (!page.dirty) {
+        page.dirty = true;
+        dirtyPages++;
+    }
+}
+
+// Copy a sector to the next slot of the open segment, its previous copy becomes stale
+void CLogStore::place(TSector secNr, const unsigned char *data) {
+    TSector address = openSegment * slots + openFill;
+    memcpy(&openData[(size_t) (summarySectors + openFill) * SECTOR_SIZE], data, SECTOR_SIZE);
+    release(lookup(secNr));
+    remap(secNr, address);
+    openLogicals[openFill] = secNr;
+    live[openSegment]++;
+    openFill++;
+}
+
+void CLogStore::release(TSector address) {
+    if (address < 0)
+        return;
+    TSector segment = address / slots;
+    if (live[segment] > 0)
+        live[segment]--;
+    changed(segment);
+}
+
+// The table page of 'segment' goes with the next checkpoint
+void CLogStore::changed(TSector segment) {
+    size_t tablePage = (size_t) (segment / TABLE_ENTRIES);
+    if (!tableDirty[tablePage]) {
+        tableDirty[tablePage] = true;
+        dirtyTables++;
+    }
+}
+
+void CLogStore::openNext() {
+    if (openSegment >= 0 || nextSegments.empty())
+        return;
+    openSegment = nextSegments.front();
+    nextSegments.pop_front();
+    state[openSegment] = SEGMENT_OPEN;
+    freeCount--;
+    openFill = 0;
+}
+
+// Write the open segment, if 'onlyFull' only a full one; appending continues in the next listed segment
+// meanwhile. A checkpoint follows the segment when 'checkpoint' is set, the list runs out or dirty pages
+// fill half the cache. Cleaned segments whose live sectors are now written are parked. False on a write
+// error or when no segment is left to append to.
+bool CLogStore::seal(bool onlyFull, bool checkpoint) {
+    TSector segment = -1;
+    Checkpoint taken;
+    bool checkpointed = false;
+    {
+        lock_guard<mutex> guard(lock);
+        if (broken)
+            return false;
+        if (openSegment >= 0 && openFill && (openFill == slots || !onlyFull)) {
+            summarize(openFill);
+            segment = sealedSegment = openSegment;
+            state[segment] = SEGMENT_SEALED;
+            changed(segment);
+            sealedData.swap(openData);
+            sealed++;
+            openSegment = -1;
+            openFill = 0;
+            openNext();
+        }
+
+        // Taken with the open segment empty, so every located sector is in a segment the record covers
+        bool due = checkpoint || openSegment < 0
+                   || (segment >= 0 && (nextSegments.empty() || dirtyPages * 2 >= mapCapacity));
+        bool unchanged = openSegment >= 0 && sealed == checkpointSealed && !dirtyPages && !dirtyTables;
+        if (due && !openFill && !unchanged) {
+            snapshot(taken);
+            checkpointed = true;
+        }
+    }
+    bool valid = segment < 0 || store(segment * segmentSectors, sealedData.data(), segmentSectors);
+    if (valid && checkpointed)
+        valid = writeCheckpoint(taken);
+
+    bool parked;
+    {
+        // Readers may still use locations in segments about to be reused
+        unique_lock<shared_timed_mutex> quiet(readers, defer_lock);
+        if (segment >= 0)
+            quiet.lock();
+        lock_guard<mutex> guard(lock);
+        if (checkpointed && !valid)
+            broken = true;
+        if (checkpointed && valid) {
+            for (size_t k = 0; k < taken.mapPages.size(); k++) {
+                mapStored[taken.mapPages[k]] = true;
+                auto found = pages.find(taken.mapPages[k]);
+                if (found->second.version == taken.versions[k]) {
+                    found->second.dirty = false;
+                    dirtyPages--;
+                }
+            }
+            counters.checkpoints++;
+            evict();
+        }
+        if (segment >= 0) {
+            state[segment] = SEGMENT_USED;
+            sealedSegment = -1;
+            if (!valid)
+                return false;
+            written++;
+            counters.writtenSegments++;
+            for (; !pending.empty() && pending.front().second <= written; pending.pop_front()) {
+                state[pending.front().first] = SEGMENT_PARKED;
+                freeCount++;
+            }
+        }
+        if (!valid)
+            return false;
+        openNext();
+        if (openSegment >= 0)
+            return true;
+        parked = freeCount > 0;
+    }
+    // Parked segments become free with the next checkpoint
+    return parked && seal(false, true);
+}
+
+// Copy what the next record covers: changed map and table pages; parked segments become free and the
+// free ones are listed to be opened after the open segment
+void CLogStore::snapshot(Checkpoint &checkpoint) {
+    for (TSector segment = 0; segment < segments; segment++)
+        if (state[segment] == SEGMENT_PARKED) {
+            state[segment] = SEGMENT_FREE;
+            changed(segment);
+        }
+
+    for (auto &page : pages)
+        if (page.second.dirty)
+            checkpoint.mapPages.push_back(page.first);
+    sort(checkpoint.mapPages.begin(), checkpoint.mapPages.end());
+    checkpoint.mapImage.assign(checkpoint.mapPages.size() * SECTOR_SIZE, 0);
+    for (size_t k = 0; k < checkpoint.mapPages.size(); k++) {
+        const MapPage &page = pages.at(checkpoint.mapPages[k]);
+        unsigned char *image = &checkpoint.mapImage[k * SECTOR_SIZE];
+        memcpy(image + PAGE_HEADER, page.entries.data(), MAP_ENTRIES * sizeof(TSector));
+        stamp(image, logId);
+        checkpoint.versions.push_back(page.version);
+    }
+
+    // Cleaned segments whose sectors moved to segments the record covers are free once it is written
+    vector<TSector> moved;
+    for (auto &entry : pending)
+        if (entry.second <= sealed) {
+            moved.push_back(entry.first);
+            changed(entry.first);
+        }
+    sort(moved.begin(), moved.end());
+
+    for (size_t tablePage = 0; tablePage < tableDirty.size(); tablePage++)
+        if (tableDirty[tablePage]) {
+            checkpoint.tablePages.push_back((TSector) tablePage);
+            tableDirty[tablePage] = false;
+        }
+    dirtyTables = 0;
+    checkpoint.tableImage.assign(checkpoint.tablePages.size() * SECTOR_SIZE, 0);
+    for (size_t k = 0; k < checkpoint.tablePages.size(); k++) {
+        unsigned char *image = &checkpoint.tableImage[k * SECTOR_SIZE];
+        for (int entry = 0; entry < TABLE_ENTRIES; entry++) {
+            TSector segment = checkpoint.tablePages[k] * TABLE_ENTRIES + entry;
+            if (segment >= segments)
+                break;
+            bool free = state[segment] == SEGMENT_FREE || state[segment] == SEGMENT_OPEN
+                        || binary_search(moved.begin(), moved.end(), segment);
+            int value = free ? 0 : live[segment] + 1;
+            memcpy(image + PAGE_HEADER + entry * sizeof(int), &value, sizeof(int));
+        }
+        stamp(image, logId);
+    }
+
+    // The record lists the open segment first, it is written next
+    vector<TSector> listed;
+    if (openSegment >= 0)
+        listed.push_back(openSegment);
+    TSector from = scanFrom;
+    for (TSector n = 0; n < segments && (int) listed.size() < RECORD_ENTRIES; n++) {
+        TSector segment = (from + n) % segments;
+        if (state[segment] == SEGMENT_FREE) {
+            listed.push_back(segment);
+            scanFrom = (segment + 1) % segments;
+        }
+    }
+    nextSegments.assign(listed.begin() + (openSegment >= 0 ? 1 : 0), listed.end());
+
+    checkpointNumber++;
+    checkpointSealed = sealed;
+    long long last = sequence - 1;
+    int count = (int) listed.size();
+    int magic = RECORD_MAGIC;
+    checkpoint.record.assign(SECTOR_SIZE, 0);
+    unsigned char *record = checkpoint.record.data();
+    memcpy(record, &magic, sizeof(int));
+    memcpy(record + 4, &logId, sizeof(unsigned));
+    memcpy(record + 8, &checkpointNumber, sizeof(long long));
+    memcpy(record + 16, &last, sizeof(long long));
+    memcpy(record + 24, &count, sizeof(int));
+    for (int k = 0; k < count; k++)
+        memcpy(record + RECORD_HEADER + k * sizeof(TSector), &listed[(size_t) k], sizeof(TSector));
+    unsigned sum = checksum(record, SECTOR_SIZE);
+    memcpy(record + 28, &sum, sizeof(unsigned));
+    checkpoint.slot = recordSlot;
+    recordSlot = 1 - recordSlot;
+}
+
+// Pages first, the record once they are on disk
+bool CLogStore::writeCheckpoint(const Checkpoint &checkpoint) {
+    return storeRuns(store, mapStart, checkpoint.mapPages, checkpoint.mapImage.data())
+           && storeRuns(store, tableStart, checkpoint.tablePages, checkpoint.tableImage.data())
+           && store(recordStart + checkpoint.slot, checkpoint.record.data(), 1);
+}
+
+// Until 'target' segments are free or about to be, move the live sectors of the segment with the
+// fewest, at most 'maxLive', to the open segment. The summary names what the segment holds, sectors the
+// map still locates there are live.
+bool CLogStore::clean(size_t target, int maxLive) {
+    vector<unsigned char> summary((size_t) summarySectors * SECTOR_SIZE);
+    vector<unsigned char> image((size_t) slots * SECTOR_SIZE);
+    vector<TSector> logicals((size_t) slots);
+    vector<unsigned> sums((size_t) slots);
+    for (TSector pass = 0; pass < segments; pass++) {
+        TSector victim = -1;
+        {
+            lock_guard<mutex> guard(lock);
+            if ((size_t) freeCount + pending.size() >= target)
+                return true;
+            for (TSector s = 0; s < segments; s++)
+                if (state[s] == SEGMENT_USED && live[s] <= maxLive && (victim < 0 || live[s] < live[victim]))
+                    victim = s;
+            if (victim < 0)
+                return true;
+        }
+
+        long long seq;
+        if (!fetch(victim * segmentSectors, summary.data(), summarySectors)
+            || !parse(summary.data(), seq, logicals.data(), sums.data()))
+            return false;
+        vector<TSector> pageNrs = pagesOf(logicals.data(), slots, logical);
+        if (!pin(pageNrs))
+            return false;
+        vector<pair<TSector, TSector>> moving; // address, logical sector
+        {
+            lock_guard<mutex> guard(lock);
+            for (int slot = 0; slot < slots; slot++) {
+                TSector address = victim * slots + slot;
+                if (logicals[slot] >= 0 && logicals[slot] < logical && lookup(logicals[slot]) == address)
+                    moving.emplace_back(address, logicals[slot]);
+            }
+        }
+
+        // The victim is not reused before this completes, sectors overwritten meanwhile are skipped
+        bool valid = moving.empty() || fetch(victim * segmentSectors + summarySectors, image.data(), slots);
+        for (size_t next = 0; valid;) {
+            {
+                lock_guard<mutex> guard(lock);
+                for (; next < moving.size() && openSegment >= 0 && openFill < slots; next++) {
+                    TSector address = moving[next].first;
+                    TSector secNr = moving[next].second;
+                    if (lookup(secNr) != address)
+                        continue;
+                    place(secNr, &image[(size_t) (address - victim * slots) * SECTOR_SIZE]);
+                    counters.relocatedSectors++;
+                }
+                if (next == moving.size()) {
+                    // Parked once the open segment holding its sectors is written
+                    state[victim] = SEGMENT_PENDING;
+                    live[victim] = 0;
+                    changed(victim);
+                    pending.emplace_back(victim, sealed + 1);
+                    counters.cleanedSegments++;
+                    break;
+                }
+            }
+            valid = seal(true);
+        }
+        unpin(pageNrs);
+        if (!valid)
+            return false;
+    }
+    return true;
+}
+
+// Summary of the open segment in front of its slots
+void CLogStore::summarize(int fill) {
+    unsigned char *summary = openData.data();
+    int magic = LOG_MAGIC;
+    memset(summary, 0, (size_t) summarySectors * SECTOR_SIZE);
+    memcpy(summary, &magic, sizeof(int));
+    memcpy(summary + 4, &logId, sizeof(unsigned));
+    memcpy(summary + 8, &sequence, sizeof(long long));
+    memcpy(summary + 16, &fill, sizeof(int));
+    for (int slot = 0; slot < slots; slot++) {
+        TSector secNr = slot < fill ? openLogicals[slot] : -1;
+        unsigned slotSum = secNr < 0 ? 0 : checksum(&openData[(size_t) (summarySectors + slot) * SECTOR_SIZE], SECTOR_SIZE);
+        memcpy(summary + SUMMARY_HEADER + slot * SUMMARY_ENTRY, &secNr, sizeof(TSector));
+        memcpy(summary + SUMMARY_HEADER + slot * SUMMARY_ENTRY + 8, &slotSum, sizeof(unsigned));
+    }
+    unsigned sum = checksum(summary, SUMMARY_HEADER + (size_t) slots * SUMMARY_ENTRY);
+    memcpy(summary + 20, &sum, sizeof(unsigned));
+    sequence++;
+}
+
+// A summary written by this log and complete
+bool CLogStore::parse(const unsigned char *summary, long long &seq, TSector *logicals, unsigned *sums) const {
+    int magic, fill;
+    unsigned id, sum;
+    memcpy(&magic, summary, sizeof(int));
+    memcpy(&id, summary + 4, sizeof(unsigned));
+    memcpy(&seq, summary + 8, sizeof(long long));
+    memcpy(&fill, summary + 16, sizeof(int));
+    memcpy(&sum, summary + 20, sizeof(unsigned));
+    if (magic != LOG_MAGIC || id != logId || fill < 0 || fill > slots)
+        return false;
+
+    vector<unsigned char> copy(summary, summary + SUMMARY_HEADER + (size_t) slots * SUMMARY_ENTRY);
+    memset(&copy[20], 0, sizeof(unsigned));
+    if (checksum(copy.data(), copy.size()) != sum)
+        return false;
+
+    for (int slot = 0; slot < slots; slot++) {
+        memcpy(&logicals[slot], summary + SUMMARY_HEADER + slot * SUMMARY_ENTRY, sizeof(TSector));
+        memcpy(&sums[slot], summary + SUMMARY_HEADER + slot * SUMMARY_ENTRY + 8, sizeof(unsigned));
+    }
+    return true;
+}
+
+// A complete checkpoint record of this log
+bool CLogStore::parseRecord(const unsigned char *record, long long &number, long long &seq,
+                            vector<TSector> &listed) const {
+    int magic, count;
+    unsigned id, sum;
+    memcpy(&magic, record, sizeof(int));
+    memcpy(&id, record + 4, sizeof(unsigned));
+    memcpy(&number, record + 8, sizeof(long long));
+    memcpy(&seq, record + 16, sizeof(long long));
+    memcpy(&count, record + 24, sizeof(int));
+    memcpy(&sum, record + 28, sizeof(unsigned));
+    if (magic != RECORD_MAGIC || id != logId || count < 0 || count > RECORD_ENTRIES)
+        return false;
+
+    vector<unsigned char> copy(record, record + SECTOR_SIZE);
+    memset(&copy[28], 0, sizeof(unsigned));
+    if (checksum(copy.data(), copy.size()) != sum)
+        return false;
+
+    listed.resize((size_t) count);
+    for (int k = 0; k < count; k++) {
+        memcpy(&listed[(size_t) k], record + RECORD_HEADER + k * sizeof(TSector), sizeof(TSector));
+        if (listed[(size_t) k] < 0 || listed[(size_t) k] >= segments)
+            return false;
+    }
+    return true;
+}
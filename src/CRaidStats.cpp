@@ -0,0 +1,167 @@
+#include <initializer_list>
+#include "../include/CRaidStats.h"
+
+using namespace std;
+
+// Counters are independent, relaxed ordering is enough
+constexpr auto RELAXED = memory_order_relaxed;
+
+// I/Os of a disk needed before its latency percentiles mean anything
+constexpr unsigned long long MIN_PERCENTILE_SAMPLES = 32;
+
+// I/Os of a disk after which the recent latency samples count half, so percentiles follow
+// a disk that turns slow or recovers
+constexpr unsigned long long LATENCY_HALF_LIFE = 256;
+
+CRaidStats::CRaidStats() : resyncStart(0), resyncStartSector(0) {
+    reset();
+}
+
+void CRaidStats::request(bool isWrite, int sectors) {
+    (isWrite ? writes : reads).fetch_add(1, RELAXED);
+    (isWrite ? writtenSectors : readSectors).fetch_add(sectors, RELAXED);
+}
+
+void CRaidStats::diskIo(int disk, bool isWrite, int sectors, bool success, chrono::nanoseconds latency) {
+    Disk &counters = disks[disk];
+    (isWrite ? counters.writes : counters.reads).fetch_add(1, RELAXED);
+    if (success)
+        (isWrite ? counters.writtenBytes : counters.readBytes).fetch_add((unsigned long long) sectors * SECTOR_SIZE, RELAXED);
+    else
+        counters.errors.fetch_add(1, RELAXED);
+
+    unsigned long long us = (unsigned long long) chrono::duration_cast<chrono::microseconds>(latency).count();
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    bucket = bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+    counters.latency[bucket].fetch_add(1, RELAXED);
+    counters.recent[bucket].fetch_add(1, RELAXED);
+
+    // Decay: the I/O completing a half-life halves the recent samples, concurrent ones only add
+    if (counters.samples.fetch_add(1, RELAXED) % LATENCY_HALF_LIFE == LATENCY_HALF_LIFE - 1)
+        for (auto &recent : counters.recent)
+            recent.fetch_sub(recent.load(RELAXED) / 2, RELAXED);
+}
+
+void CRaidStats::dispatched(int ioClass, size_t bytes, chrono::nanoseconds wait, bool late) {
+    IoClass &counters = classes[ioClass];
+    counters.ios.fetch_add(1, RELAXED);
+    counters.bytes.fetch_add(bytes, RELAXED);
+    unsigned long long us = (unsigned long long) chrono::duration_cast<chrono::microseconds>(wait).count();
+    counters.waitUs.fetch_add(us, RELAXED);
+    unsigned long long longest = counters.maxWaitUs.load(RELAXED);
+    while (us > longest && !counters.maxWaitUs.compare_exchange_weak(longest, us, RELAXED))
+        ;
+    if (late)
+        counters.lateIos.fetch_add(1, RELAXED);
+}
+
+void CRaidStats::hedged(int disk) {
+    disks[disk].hedgedReads.fetch_add(1, RELAXED);
+}
+
+unsigned long long CRaidStats::latencyPercentile(int disk, double percentile) const {
+    const Disk &counters = disks[disk];
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+        total += counts[b] = counters.recent[b].load(RELAXED);
+    if (total < MIN_PERCENTILE_SAMPLES)
+        return 0;
+
+    // Smallest bucket covering the percentile, reported by its upper bound
+    unsigned long long rank = (unsigned long long) (percentile * total);
+    unsigned long long seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS - 1; b++)
+        if ((seen += counts[b]) > rank)
+            return 1ULL << b;
+    return 1ULL << (LATENCY_BUCKETS - 1);
+}
+
+void CRaidStats::rows(int full, int reconstruct, int readModify, int dataOnly) {
+    fullRows.fetch_add(full, RELAXED);
+    reconstructRows.fetch_add(reconstruct, RELAXED);
+    readModifyRows.fetch_add(readModify, RELAXED);
+    dataOnlyRows.fetch_add(dataOnly, RELAXED);
+}
+
+void CRaidStats::reconstructed(int sectors) {
+    reconstructedSectors.fetch_add(sectors, RELAXED);
+}
+
+void CRaidStats::scrubbed(int rows, int mismatches, int repaired) {
+    scrubbedRows.fetch_add(rows, RELAXED);
+    scrubMismatches.fetch_add(mismatches, RELAXED);
+    scrubRepaired.fetch_add(repaired, RELAXED);
+}
+
+void CRaidStats::resyncStarted(TSector sector) {
+    resyncStartSector = sector;
+    resyncStart = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TRaidStats CRaidStats::snapshot() const {
+    TRaidStats stats{};
+    stats.reads = reads.load(RELAXED);
+    stats.writes = writes.load(RELAXED);
+    stats.readSectors = readSectors.load(RELAXED);
+    stats.writtenSectors = writtenSectors.load(RELAXED);
+    stats.fullRows = fullRows.load(RELAXED);
+    stats.reconstructRows = reconstructRows.load(RELAXED);
+    stats.readModifyRows = readModifyRows.load(RELAXED);
+    stats.dataOnlyRows = dataOnlyRows.load(RELAXED);
+    stats.reconstructedSectors = reconstructedSectors.load(RELAXED);
+    stats.scrubbedRows = scrubbedRows.load(RELAXED);
+    stats.scrubMismatches = scrubMismatches.load(RELAXED);
+    stats.scrubRepaired = scrubRepaired.load(RELAXED);
+
+    for (int c = 0; c < IO_CLASSES; c++) {
+        const IoClass &counters = classes[c];
+        stats.classes[c] = {counters.ios.load(RELAXED), counters.bytes.load(RELAXED), counters.waitUs.load(RELAXED),
+                            counters.maxWaitUs.load(RELAXED), counters.lateIos.load(RELAXED)};
+    }
+
+    for (int i = 0; i < MAX_RAID_DEVICES; i++) {
+        const Disk &counters = disks[i];
+        TDiskStats &disk = stats.disks[i];
+        disk.reads = counters.reads.load(RELAXED);
+        disk.writes = counters.writes.load(RELAXED);
+        disk.readBytes = counters.readBytes.load(RELAXED);
+        disk.writtenBytes = counters.writtenBytes.load(RELAXED);
+        disk.errors = counters.errors.load(RELAXED);
+        disk.hedgedReads = counters.hedgedReads.load(RELAXED);
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            disk.latency[b] = counters.latency[b].load(RELAXED);
+        stats.physicalIos += disk.reads + disk.writes;
+    }
+
+    unsigned long long requests = stats.reads + stats.writes;
+    stats.iosPerRequest = requests ? (double) stats.physicalIos / requests : 0;
+    return stats;
+}
+
+// Rebuilt sectors per second since resyncStarted()
+double CRaidStats::resyncRate(TSector sector) const {
+    long long now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    long long elapsed = now - resyncStart.load();
+    TSector rebuilt = sector - resyncStartSector.load();
+    return elapsed > 0 && rebuilt > 0 ? rebuilt * 1e9 / elapsed : 0;
+}
+
+void CRaidStats::reset() {
+    for (auto *counter : {&reads, &writes, &readSectors, &writtenSectors, &fullRows, &reconstructRows,
+                          &readModifyRows, &dataOnlyRows, &reconstructedSectors, &scrubbedRows,
+                          &scrubMismatches, &scrubRepaired})
+        counter->store(0, RELAXED);
+    for (IoClass &counters : classes)
+        for (auto *counter : {&counters.ios, &counters.bytes, &counters.waitUs, &counters.maxWaitUs, &counters.lateIos})
+            counter->store(0, RELAXED);
+    for (Disk &counters : disks) {
+        for (auto *counter : {&counters.reads, &counters.writes, &counters.readBytes, &counters.writtenBytes,
+                              &counters.errors, &counters.hedgedReads, &counters.samples})
+            counter->store(0, RELAXED);
+        for (auto &bucket : counters.latency)
+            bucket.store(0, RELAXED);
+        for (auto &bucket : counters.recent)
+            bucket.store(0, RELAXED);
+    }
+}
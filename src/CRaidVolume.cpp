@@ -1,36 +1,183 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <random>
+#include <shared_mutex>
+#include <thread>
 #include <cstdio>
 #include <cmath>
 #include <cstring>
+#include <vector>
 #include "../include/Overhead.h"
 #include "../include/CRaidVolume.h"
+#include "../include/CAllocationMap.h"
+#include "../include/CWorkerPool.h"
+#include "../include/CLogStore.h"
+#include "../include/CReadAhead.h"
+#include "../include/CStripeCache.h"
+#include "../include/CWriteBitmap.h"
+#include "../include/XorEngine.h"
 
 using namespace std;
 
+// Default number of asynchronous requests in flight
+constexpr int DEFAULT_QUEUE_DEPTH = 32;
+
+// Default memory budget of cached map pages of a log-structured volume
+constexpr size_t DEFAULT_LOG_MAP_CACHE = 4 << 20;
+
+// Logical sectors planned and transferred as one batch
+constexpr int BATCH_SECTORS = 2048;
+
+// Sectors rebuilt per batch during resync
+constexpr int RESYNC_BATCH = 1024;
+
+// Threads reconstructing a resync batch or verifying a scrub batch
+constexpr int MAX_RESYNC_THREADS = 8;
+
+// Rows verified per scrub batch, writes to them wait for the batch
+constexpr int SCRUB_BATCH = 256;
+
+// Default deadlines of queued rebuild and scrub I/O in microseconds, foreground has none
+constexpr int DEFAULT_REBUILD_DEADLINE = 100 * 1000;
+constexpr int DEFAULT_SCRUB_DEADLINE = 500 * 1000;
+
+// Default quiet time of clients in microseconds after which background I/O runs unthrottled
+constexpr int DEFAULT_IDLE_THRESHOLD = 50 * 1000;
+
+// A member whose tail latency exceeds the typical member's this many times is flagged slow
+constexpr int SLOW_DISK_FACTOR = 8;
+
+// Tail latency compared to flag slow members while hedged reads are off
+constexpr double DEFAULT_SLOW_PERCENTILE = 0.99;
+
+// Default resync progress saved to overhead every this many sectors
+constexpr int DEFAULT_RESYNC_CHECKPOINT = 64 * 1024;
+
+// Longest run sent to a disk in one call
+constexpr int MAX_RUN_SECTORS = 2048;
+
+// Unrequested sectors a coalesced read may span to join two runs
+constexpr int COALESCE_GAP = 8;
+
 // Constructor: initialize RAID state to stopped
-CRaidVolume::CRaidVolume() {
+CRaidVolume::CRaidVolume() : stripeLocks(true) {
     raid.state = RAID_STOPPED;
+    raid.chunkSectors = 1;
+    queueDepth = DEFAULT_QUEUE_DEPTH;
+    cacheSize = 0;
+    readAheadSize = 0;
+    logMapCache = DEFAULT_LOG_MAP_CACHE;
+    resyncCheckpoint = DEFAULT_RESYNC_CHECKPOINT;
+    raid.resyncSector = 0;
+    raid.bitmapSectors = 0;
+    raid.regionSectors = 0;
+    raid.allocSectors = 0;
+    raid.logId = 0;
+    raid.volumeId = 0;
+    bitmapVersion = 0;
+    allocationVersion = 0;
+    failEpoch = 0;
+    memberErrors = 0;
+    resyncRunning = false;
+    resyncCancel = false;
+    raid.scrubSector = 0;
+    scrubRunning = false;
+    scrubCancel = false;
+    scrubBytesLimit = 0;
+    scrubIopsLimit = 0;
+    stopping = false;
+    ioClasses[IO_FOREGROUND] = {0, 0, 0};
+    ioClasses[IO_REBUILD] = {0, 0, DEFAULT_REBUILD_DEADLINE};
+    ioClasses[IO_SCRUB] = {0, 0, DEFAULT_SCRUB_DEADLINE};
+    idleThreshold = DEFAULT_IDLE_THRESHOLD;
+    hedgePercentile = 0;
+    hedgeMinDeadline = 0;
+}
+
+// Destructor: stop a background resync or scrub, join disk workers of a RAID that was not stopped
+CRaidVolume::~CRaidVolume() {
+    cancelResync();
+    cancelScrub();
 }
 
-// Create RAID: write overhead info to the last sector of each disk
-bool CRaidVolume::create(const TBlkDev &dev) {
+// Create RAID: write overhead info to the last sector of each disk, a clean bitmap in front of it
+// and an empty allocation map in front of that
+bool CRaidVolume::create(const TBlkDev &dev, int chunkSize, int bitmapRegion, int flags) {
     int diskCnt = dev.m_Devices;
-    int lastSec = dev.m_Sectors - 1;
-    int timestamp = 1;
-    void *ptr = &timestamp;
+    TSector lastSec = dev.m_Sectors - 1;
+
+    // One bitmap bit per region of every sector in front of the overhead
+    int bitmapSectors = 0;
+    int regionSectors = 0;
+    if (bitmapRegion) {
+        if (bitmapRegion < SECTOR_SIZE || bitmapRegion % SECTOR_SIZE != 0)
+            return false;
+        regionSectors = bitmapRegion / SECTOR_SIZE;
+        TSector regions = (lastSec + regionSectors - 1) / regionSectors;
+        bitmapSectors = (int) ((regions + SECTOR_SIZE * 8 - 1) / (SECTOR_SIZE * 8));
+    }
+
+    // Stripe unit must be whole sectors and at least one stripe must fit
+    if (chunkSize < SECTOR_SIZE || chunkSize > MAX_CHUNK_SIZE || chunkSize % SECTOR_SIZE != 0
+        || lastSec - bitmapSectors < chunkSize / SECTOR_SIZE)
+        return false;
+
+    // One bit per stripe that fits in front of the bitmap, nothing allocated yet
+    int allocSectors = 0;
+    if (flags & RAID_ALLOCATION_MAP) {
+        TSector stripes = (lastSec - bitmapSectors) / (chunkSize / SECTOR_SIZE);
+        allocSectors = (int) ((stripes + SECTOR_SIZE * 8 - 1) / (SECTOR_SIZE * 8));
+        if (lastSec - bitmapSectors - allocSectors < chunkSize / SECTOR_SIZE)
+            return false;
+    }
+
+    // A log needs room for its reserve segments; a new id tells its summaries from older data
+    random_device random;
+    int logId = 0;
+    if (flags & RAID_LOG_STRUCTURED) {
+        int stripeSectors = chunkSize / SECTOR_SIZE * (diskCnt - 1);
+        TSector stripes = (lastSec - bitmapSectors - allocSectors) / (chunkSize / SECTOR_SIZE);
+        if (!CLogStore::logicalSize(stripes * stripeSectors, stripeSectors))
+            return false;
+        logId = (int) (random() >> 1) | 1;
+    }
+
+    // Tells members of this array from disks of another array with the same layout
+    int volumeId = (int) (random() >> 1) | 1;
+    Overhead overhead{RAID_OK, NO_DISK, 1, chunkSize / SECTOR_SIZE, 0, bitmapSectors, regionSectors, 0, allocSectors,
+                      logId, volumeId};
+    unsigned char buffer[SECTOR_SIZE];
+    writeToBuffer(overhead, buffer);
+    vector<unsigned char> clean((size_t) max(bitmapSectors, allocSectors) * SECTOR_SIZE);
     bool valid = true;
 
-    for (int i = 0; i < diskCnt; i++)
-        if (!dev.m_Write(i, lastSec, ptr, 1))
+    for (int i = 0; i < diskCnt; i++) {
+        if (bitmapSectors && !dev.m_Write(i, lastSec - bitmapSectors, clean.data(), bitmapSectors))
+            valid = false;
+        if (allocSectors && !dev.m_Write(i, lastSec - bitmapSectors - allocSectors, clean.data(), allocSectors))
+            valid = false;
+        if (!dev.m_Write(i, lastSec, buffer, 1))
             valid = false; // failed to write overhead
+    }
 
     return valid;
 }
 
 // Start RAID: read overhead, detect degraded/failed state
 int CRaidVolume::start(const TBlkDev &dev) {
+    unique_lock<shared_timed_mutex> running(runLock);
     raid.dev = dev;
+    asyncQueue.reset();
+    readAhead.reset();
+    cache.reset();
+    bitmap.reset();
+    allocation.reset();
+    logStore.reset();
+    scheduler.reset(new CIoScheduler(dev.m_Devices, ioClasses, chrono::microseconds(idleThreshold)));
     int diskCnt = dev.m_Devices;
-    int lastSec = dev.m_Sectors - 1;
+    TSector lastSec = dev.m_Sectors - 1;
     unsigned char buffer[SECTOR_SIZE];
 
     // Read first three disks' overhead
@@ -54,56 +201,79 @@ int CRaidVolume::start(const TBlkDev &dev) {
             return raid.state = RAID_FAILED;
     }
 
-    // Compare timestamps to find correct version
-    int timestamps[3];
+    // Compare timestamps to find correct version; a disk of another array never matches
+    long long versions[3];
     for (int i = 0; i < 3; i++)
-        timestamps[i] = overhead[i].timestamp;
+        versions[i] = (long long) overhead[i].volumeId << 32 | (unsigned) overhead[i].timestamp;
 
     if (raid.state == RAID_DEGRADED) {
         // One degraded disk -> compare two correct disks
         if (raid.failedDisk == 0) {
-            if (timestamps[1] == timestamps[2])
-                raid.timestamp = timestamps[1];
+            if (versions[1] == versions[2])
+                raid.timestamp = overhead[1].timestamp;
             else
                 return raid.state = RAID_FAILED; // two degraded disks
         } else if (raid.failedDisk == 1) {
-            if (timestamps[0] == timestamps[2])
-                raid.timestamp = timestamps[0];
+            if (versions[0] == versions[2])
+                raid.timestamp = overhead[0].timestamp;
             else
                 return raid.state = RAID_FAILED;
         } else {
-            if (timestamps[0] == timestamps[1])
-                raid.timestamp = timestamps[0];
+            if (versions[0] == versions[1])
+                raid.timestamp = overhead[0].timestamp;
             else
                 return raid.state = RAID_FAILED;
         }
     }
 
     // Determine state if all disks readable
-    if (timestamps[0] == timestamps[1]) {
-        raid.timestamp = timestamps[0];
-        if (timestamps[1] == timestamps[2]) {
+    if (versions[0] == versions[1]) {
+        raid.timestamp = overhead[0].timestamp;
+        if (versions[1] == versions[2]) {
             raid.state = RAID_OK;
             raid.failedDisk = NO_DISK;
         } else {
             raid.failedDisk = 2;
             raid.state = RAID_DEGRADED;
         }
-    } else if (timestamps[1] == timestamps[2]) {
-        raid.timestamp = timestamps[1];
+    } else if (versions[1] == versions[2]) {
+        raid.timestamp = overhead[1].timestamp;
         raid.failedDisk = 0;
         raid.state = RAID_DEGRADED;
-    } else if (timestamps[0] == timestamps[2]) {
-        raid.timestamp = timestamps[0];
+    } else if (versions[0] == versions[2]) {
+        raid.timestamp = overhead[0].timestamp;
         raid.failedDisk = 1;
         raid.state = RAID_DEGRADED;
     } else
         return raid.state = RAID_FAILED;
 
+    // Stripe unit and bitmap layout from a disk holding the current overhead
+    for (int i = 0; i < 3; i++)
+        if (i != raid.failedDisk) {
+            raid.chunkSectors = overhead[i].chunkSectors;
+            raid.bitmapSectors = overhead[i].bitmapSectors;
+            raid.regionSectors = overhead[i].regionSectors;
+            raid.scrubSector = overhead[i].scrubSector;
+            raid.allocSectors = overhead[i].allocSectors;
+            raid.logId = overhead[i].logId;
+            raid.volumeId = overhead[i].volumeId;
+            break;
+        }
+    if (raid.chunkSectors < 1 || raid.chunkSectors > MAX_CHUNK_SIZE / SECTOR_SIZE
+        || raid.bitmapSectors < 0 || (raid.bitmapSectors && raid.regionSectors < 1) || raid.allocSectors < 0
+        || stripeCount() < 1)
+        return raid.state = RAID_FAILED;
+    stripeMap = CStripeMap(diskCnt, raid.chunkSectors);
+
     // Check remaining disks for consistency
     int timestamp = raid.timestamp;
     for (int i = 3; i < diskCnt; i++) {
-        if (!dev.m_Read(i, lastSec, buffer, 1) || readFromBuffer(buffer).timestamp != timestamp) {
+        bool current = dev.m_Read(i, lastSec, buffer, 1);
+        if (current) {
+            Overhead other = readFromBuffer(buffer);
+            current = other.timestamp == timestamp && other.volumeId == raid.volumeId;
+        }
+        if (!current) {
             if (raid.state == RAID_OK) {
                 // Store failed disk
                 raid.failedDisk = i;
@@ -113,33 +283,137 @@ int CRaidVolume::start(const TBlkDev &dev) {
         }
     }
 
+    // Resume an interrupted resync of the same disk
+    raid.resyncSector = 0;
+    if (raid.state == RAID_DEGRADED)
+        for (int i = 0; i < 3; i++)
+            if (i != raid.failedDisk) {
+                if (overhead[i].failedDisk == raid.failedDisk)
+                    raid.resyncSector = overhead[i].resyncSector;
+                break;
+            }
+
+    // Bits set on any current disk: regions written before a crash or missed by the failed disk
+    if (raid.bitmapSectors) {
+        TSector dataSectors = stripeCount() * raid.chunkSectors;
+        bitmap.reset(new CWriteBitmap((dataSectors + raid.regionSectors - 1) / raid.regionSectors, raid.regionSectors));
+        bitmapVersion = 0;
+        vector<unsigned char> bits((size_t) raid.bitmapSectors * SECTOR_SIZE);
+        for (int i = 0; i < diskCnt; i++)
+            if (i != raid.failedDisk && dev.m_Read(i, lastSec - raid.bitmapSectors, bits.data(), raid.bitmapSectors))
+                bitmap->load(bits.data(), raid.bitmapSectors);
+
+        // Unclean shutdown: writes in flight may have left parity stale
+        if (raid.state == RAID_OK && !bitmap->empty())
+            repairParity();
+        bitmap->startCleaner([this] { clearBitmap(false); });
+    }
+
+    // Stripes allocated on any current disk
+    if (raid.allocSectors) {
+        allocation.reset(new CAllocationMap(stripeCount()));
+        allocationVersion = 0;
+        TSector first = lastSec - raid.bitmapSectors - raid.allocSectors;
+        vector<unsigned char> bits((size_t) raid.allocSectors * SECTOR_SIZE);
+        for (int i = 0; i < diskCnt; i++)
+            if (i != raid.failedDisk && dev.m_Read(i, first, bits.data(), raid.allocSectors))
+                allocation->load(bits.data(), raid.allocSectors);
+    }
+
+    // Map of a log-structured volume from its last checkpoint and the segments written after it
+    if (raid.logId) {
+        int stripeSectors = stripeMap.stripeSectors();
+        logStore.reset(new CLogStore(stripeCount() * stripeSectors, stripeSectors, (unsigned) raid.logId, logMapCache,
+                                     [this](TSector secNr, unsigned char *data, int count) {
+                                         return readThrough(secNr, {data, nullptr}, count);
+                                     },
+                                     [this](TSector secNr, const unsigned char *data, int count) {
+                                         return writeThrough(secNr, {(unsigned char *) data, nullptr}, count);
+                                     }));
+        if (!logStore->recover())
+            return raid.state = RAID_FAILED;
+        logStore->startFlusher();
+    }
+
+    if (cacheSize) {
+        cache.reset(new CStripeCache(dev.m_Devices, cacheSize));
+        cache->startFlusher([this] { flushCache(); });
+    }
+    // Logical sectors of a log are scattered, there is no sequential stream to follow
+    if (readAheadSize && !logStore)
+        readAhead.reset(new CReadAhead(readAheadSize, raid.chunkSectors * (dev.m_Devices - 1), size(),
+                                       [this](TSector secNr, unsigned char *data, int count) {
+                                           return readThrough(secNr, {data, nullptr}, count);
+                                       }));
+    asyncQueue.reset(new CAsyncQueue(queueDepth));
+
     return raid.state;
 }
 
 // Stop RAID: update overhead and mark stopped
 int CRaidVolume::stop() {
-    if (raid.state == RAID_STOPPED)
+    // Requests in progress finish first, later ones fail
+    stopping = true;
+    resyncCancel = true;
+    scrubCancel = true;
+    {
+        // Callers blocked in reap() hold the RAID running
+        shared_lock<shared_timed_mutex> active(runLock);
+        if (asyncQueue)
+            asyncQueue->interrupt();
+    }
+    unique_lock<shared_timed_mutex> running(runLock);
+    stopping = false;
+    if (raid.state == RAID_STOPPED) {
+        resyncCancel = false;
+        scrubCancel = false;
         return RAID_STOPPED;
+    }
+
+    // Interrupt resync and scrub at their checkpoints, finish outstanding requests,
+    // write back cached rows, finish member I/O
+    cancelResync();
+    cancelScrub();
+    asyncQueue.reset();
+    readAhead.reset();
+    if (logStore) {
+        logStore->stopFlusher();
+        logStore->flush();
+        logStore.reset();
+    }
+    if (cache) {
+        cache->stopFlusher();
+        flushCache();
+        cache.reset();
+    }
+    if (bitmap) {
+        // Clean shutdown of a consistent RAID leaves no dirty regions
+        bitmap->stopCleaner();
+        clearBitmap(true);
+        bitmap.reset();
+    }
+    allocation.reset();
+    scheduler.reset();
 
     int diskCnt = raid.dev.m_Devices;
-    int lastSec = raid.dev.m_Sectors - 1;
+    TSector lastSec = raid.dev.m_Sectors - 1;
     raid.timestamp++;
 
-    // Copy overhead data to buffer
     unsigned char buffer[SECTOR_SIZE];
-    memcpy(buffer, &raid.timestamp, sizeof(int));
-    memcpy(buffer + sizeof(int), &raid.state, sizeof(int));
-    memcpy(buffer + sizeof(int) * 2, &raid.failedDisk, sizeof(int));
 
-    // If failed, update first three disks only
+    // If failed, mark the state on the first three disks only: start() may have failed before
+    // the layout was loaded, so the rest of their overhead is kept
     if (raid.state == RAID_FAILED) {
-        raid.dev.m_Write(0, lastSec, buffer, 1);
-        raid.dev.m_Write(1, lastSec, buffer, 1);
-        raid.dev.m_Write(2, lastSec, buffer, 1);
+        for (int i = 0; i < 3; i++)
+            if (raid.dev.m_Read(i, lastSec, buffer, 1)) {
+                writeStateToBuffer(RAID_FAILED, buffer);
+                raid.dev.m_Write(i, lastSec, buffer, 1);
+            }
         return raid.state = RAID_STOPPED;
     }
 
     // Write overhead to all disks except failed
+    writeToBuffer(currentOverhead(), buffer);
     int failedDisk = raid.failedDisk;
     for (int i = 0; i < diskCnt; i++) {
         if (i != failedDisk)
@@ -152,8 +426,7 @@ int CRaidVolume::stop() {
                 } else if (raid.state == RAID_OK) {
                     raid.state = RAID_DEGRADED;
                     raid.failedDisk = i;
-                    memcpy(buffer + sizeof(int), &raid.state, sizeof(int));
-                    memcpy(buffer + sizeof(int) * 2, &raid.failedDisk, sizeof(int));
+                    writeToBuffer(currentOverhead(), buffer);
                     i = 0; // rewrite all disks
                 }
             }
@@ -162,110 +435,497 @@ int CRaidVolume::stop() {
     return raid.state = RAID_STOPPED;
 }
 
-// Resync RAID if degraded: rebuild missing disk
+// Resync RAID if degraded: rebuild missing disk, waits for a resync already running in the background
 int CRaidVolume::resync() {
+    shared_lock<shared_timed_mutex> running(runLock);
+    lock_guard<mutex> guard(resyncLock);
+    if (resyncThread.joinable())
+        resyncThread.join();
+    return rebuild();
+}
+
+// Run resync on a background thread
+bool CRaidVolume::startResync() {
+    shared_lock<shared_timed_mutex> running(runLock);
+    lock_guard<mutex> guard(resyncLock);
+    if (raid.state != RAID_DEGRADED || resyncRunning)
+        return false;
+    if (resyncThread.joinable())
+        resyncThread.join();
+
+    resyncRunning = true;
+    resyncCancel = false;
+    resyncThread = thread([this] {
+        rebuild();
+        resyncRunning = false;
+    });
+    return true;
+}
+
+int CRaidVolume::waitResync() {
+    lock_guard<mutex> guard(resyncLock);
+    if (resyncThread.joinable())
+        resyncThread.join();
+    return raid.state;
+}
+
+TSector CRaidVolume::resyncProgress() const {
+    return raid.resyncSector;
+}
+
+// Rebuild the failed disk of a degraded RAID.
+// Reads of the next batch overlap reconstruction and the write of the current one;
+// progress is checkpointed in the overhead so an interrupted resync resumes.
+// Foreground I/O continues: the failed disk is served and written below the watermark,
+// writes to rows being rebuilt wait for their batch.
+int CRaidVolume::rebuild() {
     if (raid.state == RAID_DEGRADED) {
-        // Get previous data from remaining disks
-        unsigned char previous[SECTOR_SIZE];
-        unsigned char tmp[SECTOR_SIZE];
+        // Rebuild from disks holding every cached write
+        flushCache();
+
+        int devices = raid.dev.m_Devices;
         int failedDisk = raid.failedDisk;
+        int chunk = raid.chunkSectors;
+        TSector dataSectors = stripeCount() * chunk;
+        int threads = max(1, min((int) thread::hardware_concurrency(), MAX_RESYNC_THREADS));
+        bool partial = bitmapCovers(failedDisk);
+        statistics.resyncStarted(raid.resyncSector);
+        int epoch;
+        {
+            lock_guard<mutex> guard(stateLock);
+            epoch = failEpoch;
+        }
+        CWorkerPool pool(threads);
+
+        // Two sets of buffers: one being read, one being rebuilt and written
+        vector<unsigned char> loaded[2], rebuilt[2];
+        vector<DiskRun> reads[2], writes[2];
+        unique_ptr<CCompletion> readDone[2], writeDone[2];
+        bool clean[2] = {false, false};
+        for (int i = 0; i < 2; i++) {
+            loaded[i].resize((size_t) devices * RESYNC_BATCH * SECTOR_SIZE);
+            rebuilt[i].resize((size_t) RESYNC_BATCH * SECTOR_SIZE);
+        }
 
-        // Evaluate data from remained disks and write it to new disk
-        for (int sector = 0; sector < raid.dev.m_Sectors - 1; sector++) {
-            // Get data from first valid disk
-            if (failedDisk != 0) {
-                if (!myRead(0, sector, previous))
-                    break;
-            } else {
-                if (!myRead(1, sector, previous))
-                    break;
+        // Rows of each batch are locked from its read until its write is done, oldest first
+        deque<int> windows;
+
+        // One multi-sector read per remaining disk, all disks in parallel.
+        // A disk that only dropped out missed nothing outside the dirty regions of the bitmap.
+        auto startRead = [&](TSector sector, int slot) {
+            int count = (int) min<TSector>(RESYNC_BATCH, dataSectors - sector);
+            windows.push_back(rowLocks.lock(sector, sector + count, true));
+            clean[slot] = (partial && !bitmap->dirty(sector, sector + count))
+                          || (allocation && !allocation->any(sector / chunk, (sector + count - 1) / chunk + 1));
+            reads[slot].clear();
+            for (int disk = 0; disk < devices && !clean[slot]; disk++)
+                if (disk != failedDisk)
+                    reads[slot].push_back({disk, sector, count, &loaded[slot][(size_t) disk * RESYNC_BATCH * SECTOR_SIZE], false});
+            readDone[slot].reset(new CCompletion((int) reads[slot].size()));
+            startRuns(reads[slot], false, *readDone[slot], IO_REBUILD);
+        };
+
+        // Wait for the write of a batch and advance the watermark past it
+        bool valid = true;
+        auto finishWrite = [&](int slot) {
+            if (!writeDone[slot])
+                return;
+            writeDone[slot]->wait();
+            writeDone[slot].reset();
+            bool written = finishRuns(writes[slot]);
+            TSector rebuiltSector = writes[slot][0].sector + writes[slot][0].count;
+            bool checkpoint = false;
+            {
+                // The disk must not have failed again since the batch was read
+                lock_guard<mutex> guard(stateLock);
+                if (!written || raid.state != RAID_DEGRADED || failEpoch != epoch)
+                    valid = false;
+                else {
+                    checkpoint = rebuiltSector / resyncCheckpoint != raid.resyncSector / resyncCheckpoint;
+                    raid.resyncSector = rebuiltSector;
+                }
+            }
+            rowLocks.unlock(windows.front());
+            windows.pop_front();
+            if (checkpoint)
+                saveOverhead();
+        };
+
+        int slot = 0;
+        TSector start = raid.resyncSector;
+        if (start < dataSectors)
+            startRead(start, slot);
+
+        for (TSector sector = start; sector < dataSectors && valid && !resyncCancel; sector += RESYNC_BATCH, slot ^= 1) {
+            int count = (int) min<TSector>(RESYNC_BATCH, dataSectors - sector);
+            readDone[slot]->wait();
+            if (!finishRuns(reads[slot])) {
+                valid = false;
+                break;
             }
 
-            // Next after first disk
-            int disk = (failedDisk == 0) ? 2 : 1;
-
-            // Evaluate previous data from remaining disks
-            for (; disk < raid.dev.m_Devices; disk++) {
-                if (disk != raid.failedDisk) {
-                    // Get data from other disk
-                    if (!myRead(disk, sector, tmp))
-                        return raid.state;
+            // Prefetch the next batch while this one is rebuilt
+            if (sector + count < dataSectors)
+                startRead(sector + count, slot ^ 1);
 
-                    // XOR it with other data
-                    for (int byteNumber = 0; byteNumber < SECTOR_SIZE; ++byteNumber)
-                        previous[byteNumber] ^= tmp[byteNumber];
-                }
+            // Clean batch: nothing to rebuild, only the watermark moves past it
+            if (clean[slot]) {
+                finishWrite(slot ^ 1);
+                writes[slot] = {{failedDisk, sector, count, nullptr, true}};
+                writeDone[slot].reset(new CCompletion(0));
+                continue;
             }
 
-            // Write evaluated previous data to renewed disk
-            if (!myWrite(failedDisk, sector, previous))
-                return raid.state = RAID_DEGRADED;
+            // XOR the same sector of all remaining disks, sectors split across the pool
+            int part = (count + threads - 1) / threads;
+            CCompletion xorDone((count + part - 1) / part);
+            for (int first = 0, lane = 0; first < count; first += part, lane++)
+                pool.submit(lane, [&, first, slot] {
+                    for (int i = first; i < min(count, first + part); i++) {
+                        const unsigned char *src[MAX_RAID_DEVICES];
+                        int srcCnt = 0;
+                        for (int disk = 0; disk < devices; disk++)
+                            if (disk != failedDisk)
+                                src[srcCnt++] = &loaded[slot][((size_t) disk * RESYNC_BATCH + i) * SECTOR_SIZE];
+                        xorParity(&rebuilt[slot][(size_t) i * SECTOR_SIZE], src, srcCnt, SECTOR_SIZE);
+                    }
+                    xorDone.done();
+                });
+            xorDone.wait();
+
+            // Write evaluated previous data to renewed disk without waiting for it
+            finishWrite(slot ^ 1);
+            writes[slot] = {{failedDisk, sector, count, rebuilt[slot].data(), false}};
+            writeDone[slot].reset(new CCompletion(1));
+            startRuns(writes[slot], true, *writeDone[slot], IO_REBUILD);
+        }
+
+        // Drain the pipeline: the older batch finishes first, then unwritten windows are dropped
+        for (int i = 0; i < 2; i++) {
+            if (readDone[i])
+                readDone[i]->wait();
+        }
+        finishWrite(slot);
+        finishWrite(slot ^ 1);
+        for (int handle : windows)
+            rowLocks.unlock(handle);
+
+        {
+            lock_guard<mutex> guard(stateLock);
+            if (!valid || raid.state != RAID_DEGRADED)
+                return raid.state == RAID_FAILED ? RAID_FAILED : raid.state = RAID_DEGRADED;
+            if (resyncCancel && raid.resyncSector < dataSectors)
+                return raid.state;
+
+            raid.state = RAID_OK;
+            raid.failedDisk = NO_DISK;
+            raid.resyncSector = 0;
+        }
+
+        // Map updates skipped the renewed disk, it gets the whole map
+        if (allocation)
+            saveAllocation(allocation->touchAll());
+    }
+
+    return raid.state;
+}
+
+// Verify parity of every row of a consistent RAID from the checkpoint on; mismatching parity is
+// counted and, if 'repair', evaluated again from the data. Batches are read from all disks at
+// once and verified by a worker pool, then paced to the scrub limits. A read error fails the
+// disk like any other I/O, which is how latent sector errors surface before a rebuild needs them.
+void CRaidVolume::scrub(bool repair) {
+    int devices = raid.dev.m_Devices;
+    int chunk = raid.chunkSectors;
+    TSector dataSectors = stripeCount() * chunk;
+    int threads = max(1, min((int) thread::hardware_concurrency(), MAX_RESYNC_THREADS));
+    CWorkerPool pool(threads);
+    vector<unsigned char> loaded((size_t) devices * SCRUB_BATCH * SECTOR_SIZE);
+    vector<unsigned char> evaluated((size_t) SCRUB_BATCH * SECTOR_SIZE);
+    vector<char> mismatch(SCRUB_BATCH);
+    auto slot = [&](int disk, int i) { return &loaded[((size_t) disk * SCRUB_BATCH + i) * SECTOR_SIZE]; };
+    auto next = chrono::steady_clock::now();
+
+    TSector sector = raid.scrubSector;
+    if (sector < 0 || sector >= dataSectors)
+        sector = 0;
+    while (sector < dataSectors && raid.state == RAID_OK && !scrubCancel) {
+        int count = (int) min<TSector>(SCRUB_BATCH, dataSectors - sector);
+        int mismatches = 0;
+        int rows = 0;
+        vector<SectorIo> writes;
+        {
+            // Rows are compared as a whole, writers wait for the batch; released stripes hold nothing
+            CRangeGuard rowGuard(rowLocks, sector, sector + count, true);
+            auto mapped = [&](TSector row) { return !allocation || allocation->mapped(row / chunk); };
+            for (int i = 0; i < count; i++)
+                rows += mapped(sector + i);
+            vector<DiskRun> reads;
+            for (int disk = 0; disk < devices && rows; disk++)
+                reads.push_back({disk, sector, count, slot(disk, 0), false});
+            if (!transferRuns(reads, false, IO_SCRUB))
+                break;
+
+            // Evaluate parity of each row from its data, rows split across the pool
+            int part = (count + threads - 1) / threads;
+            CCompletion verified(rows ? (count + part - 1) / part : 0);
+            for (int first = 0, lane = 0; first < count && rows; first += part, lane++)
+                pool.submit(lane, [&, first] {
+                    for (int i = first; i < min(count, first + part); i++) {
+                        mismatch[i] = false;
+                        if (!mapped(sector + i))
+                            continue;
+                        int diskParity = (int) ((sector + i) / chunk % devices);
+                        const unsigned char *src[MAX_RAID_DEVICES];
+                        int srcCnt = 0;
+                        for (int disk = 0; disk < devices; disk++)
+                            if (disk != diskParity)
+                                src[srcCnt++] = slot(disk, i);
+                        unsigned char *parity = &evaluated[(size_t) i * SECTOR_SIZE];
+                        xorParity(parity, src, srcCnt, SECTOR_SIZE);
+                        mismatch[i] = memcmp(parity, slot(diskParity, i), SECTOR_SIZE) != 0;
+                    }
+                    verified.done();
+                });
+            verified.wait();
+
+            for (int i = 0; i < count && rows; i++)
+                if (mismatch[i]) {
+                    mismatches++;
+                    if (repair)
+                        writes.push_back({(int) ((sector + i) / chunk % devices), sector + i, &evaluated[(size_t) i * SECTOR_SIZE]});
+                }
+            if (!writes.empty() && !writeBatch(writes, IO_SCRUB))
+                break;
         }
+        statistics.scrubbed(rows, mismatches, (int) writes.size());
+
+        bool checkpoint = (sector + count) / resyncCheckpoint != sector / resyncCheckpoint;
+        sector += count;
+        raid.scrubSector = sector < dataSectors ? sector : 0;
+        if (checkpoint || sector >= dataSectors)
+            saveOverhead();
+
+        // Pace to the limits: each batch costs its share of a second, at most a second of credit builds up
+        long long bytesLimit = scrubBytesLimit;
+        int iopsLimit = scrubIopsLimit;
+        double cost = 0;
+        if (bytesLimit)
+            cost = max(cost, (double) (devices * (rows ? count : 0) + writes.size()) * SECTOR_SIZE / bytesLimit);
+        if (iopsLimit && rows)
+            cost = max(cost, (double) (devices + !writes.empty()) / iopsLimit);
+        next = max(next, chrono::steady_clock::now() - chrono::seconds(1))
+               + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(cost));
+        unique_lock<mutex> pace(scrubPaceLock);
+        scrubPace.wait_until(pace, next, [this] { return scrubCancel.load(); });
+    }
+}
 
-        raid.state = RAID_OK;
-        raid.failedDisk = NO_DISK;
+// Interrupt a background resync, its progress stays in the watermark
+void CRaidVolume::cancelResync() {
+    lock_guard<mutex> guard(resyncLock);
+    resyncCancel = true;
+    if (resyncThread.joinable())
+        resyncThread.join();
+    resyncCancel = false;
+}
+
+// Run scrub on a background thread
+bool CRaidVolume::startScrub(bool repair) {
+    shared_lock<shared_timed_mutex> running(runLock);
+    lock_guard<mutex> guard(resyncLock);
+    if (raid.state != RAID_OK || scrubRunning)
+        return false;
+    if (scrubThread.joinable())
+        scrubThread.join();
+
+    scrubRunning = true;
+    scrubCancel = false;
+    scrubThread = thread([this, repair] {
+        scrub(repair);
+        scrubRunning = false;
+    });
+    return true;
+}
+
+// Interrupt a background scrub, its progress stays in the overhead checkpoint
+void CRaidVolume::cancelScrub() {
+    lock_guard<mutex> guard(resyncLock);
+    {
+        lock_guard<mutex> pace(scrubPaceLock);
+        scrubCancel = true;
+        scrubPace.notify_all();
     }
+    if (scrubThread.joinable())
+        scrubThread.join();
+    scrubCancel = false;
+}
 
+int CRaidVolume::waitScrub() {
+    lock_guard<mutex> guard(resyncLock);
+    if (scrubThread.joinable())
+        scrubThread.join();
     return raid.state;
 }
 
+void CRaidVolume::setScrubLimit(long long bytesPerSecond, int iosPerSecond) {
+    scrubBytesLimit = max(0LL, bytesPerSecond);
+    scrubIopsLimit = max(0, iosPerSecond);
+}
+
+void CRaidVolume::setIoClass(int ioClass, const TIoClassConfig &config) {
+    if (ioClass < 0 || ioClass >= IO_CLASSES)
+        return;
+    shared_lock<shared_timed_mutex> running(runLock);
+    lock_guard<mutex> guard(qosLock);
+    ioClasses[ioClass] = {max(0LL, config.rate), max(0LL, config.burst), max(0, config.deadlineUs)};
+    if (scheduler)
+        scheduler->configure(ioClass, ioClasses[ioClass]);
+}
+
+void CRaidVolume::setHedgedReads(double percentile, int minDeadlineUs) {
+    hedgePercentile = min(1.0, max(0.0, percentile));
+    hedgeMinDeadline = max(0, minDeadlineUs);
+}
+
+void CRaidVolume::setIdleThreshold(int microseconds) {
+    shared_lock<shared_timed_mutex> running(runLock);
+    lock_guard<mutex> guard(qosLock);
+    idleThreshold = max(0, microseconds);
+    if (scheduler)
+        scheduler->setIdleThreshold(chrono::microseconds(idleThreshold));
+}
+
 int CRaidVolume::status() const {
     return raid.state;
 }
 
-// Total usable sectors
-int CRaidVolume::size() const {
-    return (raid.dev.m_Sectors - 1) * (raid.dev.m_Devices - 1);
+// Total usable sectors, a log keeps some for cleaning
+TSector CRaidVolume::size() const {
+    int stripeSectors = raid.chunkSectors * (raid.dev.m_Devices - 1);
+    TSector sectors = stripeCount() * stripeSectors;
+    return raid.logId ? CLogStore::logicalSize(sectors, stripeSectors) : sectors;
 }
 
 // Read RAID sectors, handle degraded/failure
-bool CRaidVolume::read(int secNr, void *data, int secCnt) {
-    Evaluation res{};
-    int maxSec = secNr + secCnt;
-    auto *dataPtr = (unsigned char *) data;
+bool CRaidVolume::read(TSector secNr, void *data, int secCnt) {
+    shared_lock<shared_timed_mutex> running;
+    if (!enter(running) || !inRange(secNr, secCnt))
+        return false;
+    return readSectors(secNr, {(unsigned char *) data, nullptr}, secCnt);
+}
 
-    if (raid.state == RAID_OK) {
-        for (; secNr < maxSec; secNr++, dataPtr += SECTOR_SIZE) {
-            res = findSector(secNr);
-            if (!myRead(res.disk, res.sector, dataPtr))
-                break;
+// Write RAID sectors with parity updates
+bool CRaidVolume::write(TSector secNr, const void *data, int secCnt) {
+    shared_lock<shared_timed_mutex> running;
+    if (!enter(running) || !inRange(secNr, secCnt))
+        return false;
+    return writeSectors(secNr, {(unsigned char *) data, nullptr}, secCnt);
+}
+
+// Read into scatter-gather segments, their total length must be whole sectors
+bool CRaidVolume::readv(TSector secNr, const iovec *iov, int iovCnt) {
+    shared_lock<shared_timed_mutex> running;
+    if (!enter(running))
+        return false;
+    vector<unsigned char *> sectors;
+    vector<unsigned char> bounce;
+    if (!mapSegments(iov, iovCnt, sectors, bounce, false) || !inRange(secNr, (TSector) sectors.size()))
+        return false;
+    if (!readSectors(secNr, {nullptr, sectors.data()}, (int) sectors.size()))
+        return false;
+    mapSegments(iov, iovCnt, sectors, bounce, true);
+    return true;
+}
+
+// Write from scatter-gather segments, their total length must be whole sectors
+bool CRaidVolume::writev(TSector secNr, const iovec *iov, int iovCnt) {
+    shared_lock<shared_timed_mutex> running;
+    if (!enter(running))
+        return false;
+    vector<unsigned char *> sectors;
+    vector<unsigned char> bounce;
+    return mapSegments(iov, iovCnt, sectors, bounce, false) && inRange(secNr, (TSector) sectors.size())
+           && writeSectors(secNr, {nullptr, sectors.data()}, (int) sectors.size());
+}
+
+// Read a request: prefetched leading sectors from memory, the rest from the disks; through the log
+// on a log-structured volume
+bool CRaidVolume::readSectors(TSector secNr, IoBuffer buffer, int secCnt) {
+    statistics.request(false, secCnt);
+    if (logStore)
+        return logStore->read(secNr, secCnt, [&buffer](int i) { return buffer.at(i); });
+    if (readAhead && (raid.state == RAID_OK || raid.state == RAID_DEGRADED)) {
+        int served = readAhead->read(secNr, secCnt, [&](int offset, const unsigned char *data, int count) {
+            for (int i = 0; i < count; i++)
+                memcpy(buffer.at(offset + i), data + (size_t) i * SECTOR_SIZE, SECTOR_SIZE);
+        });
+        secNr += served;
+        secCnt -= served;
+        buffer = buffer.from(served);
+    }
+    return readThrough(secNr, buffer, secCnt);
+}
+
+// Read from the disks in windows of BATCH_SECTORS
+bool CRaidVolume::readThrough(TSector secNr, IoBuffer buffer, int secCnt) {
+    TSector maxSec = secNr + secCnt;
+
+    for (int done = 0; secNr < maxSec && (raid.state == RAID_OK || raid.state == RAID_DEGRADED);) {
+        int count = (int) min<TSector>(BATCH_SECTORS, maxSec - secNr);
+        unsigned errors = memberErrors;
+        if (!readRange(secNr, buffer.from(done), count)) {
+            if (memberErrors == errors)
+                return false; // no member failed, the same range would fail again
+            continue; // state changed, read the range again in the new state
         }
+        secNr += count;
+        done += count;
     }
 
-    if (raid.state == RAID_DEGRADED) {
-        for (; secNr < maxSec; secNr++, dataPtr += SECTOR_SIZE) {
-            res = findSector(secNr);
+    if (raid.state == RAID_FAILED || raid.state == RAID_STOPPED)
+        return false;
 
-            // Read from valid disk
-            if (res.disk != raid.failedDisk && !myRead(res.disk, res.sector, dataPtr))
-                break;
+    return true;
+}
 
-            // Read from broken disk
-            if (res.disk == raid.failedDisk) {
-                // Evaluate data from remaining disks
-                int sector = res.sector;
-                unsigned char buffer[SECTOR_SIZE];
-                memset(buffer, 0, SECTOR_SIZE); // reset all bytes of the buffer
-
-                // Iterate through each disk
-                for (int disk = 0; disk < raid.dev.m_Devices; disk++) {
-                    // Skip broken disk
-                    if (disk == raid.failedDisk)
-                        continue;
-
-                    // Load data from the disk
-                    unsigned char loadedData[SECTOR_SIZE];
-                    if (!myRead(disk, sector, loadedData))
-                        return false;
-
-                    // XOR data from the disk with the buffer
-                    for (int byteNumber = 0; byteNumber < SECTOR_SIZE; byteNumber++)
-                        buffer[byteNumber] ^= loadedData[byteNumber];
-                }
+// Write a request, appended to the log on a log-structured volume
+bool CRaidVolume::writeSectors(TSector secNr, IoBuffer buffer, int secCnt) {
+    statistics.request(true, secCnt);
+    if (logStore)
+        return logStore->write(secNr, secCnt, [&buffer](int i) { return buffer.at(i); })
+               && (raid.state == RAID_OK || raid.state == RAID_DEGRADED);
 
-                // Write evaluated data to output data
-                memcpy(dataPtr, buffer, SECTOR_SIZE);
-            }
+    bool valid = writeThrough(secNr, buffer, secCnt);
+
+    // Prefetched copies of the written sectors are stale, even if the write failed halfway
+    if (readAhead)
+        readAhead->invalidate(secNr, secNr + secCnt);
+    return valid;
+}
+
+// Write to the disks in windows of whole stripes
+bool CRaidVolume::writeThrough(TSector secNr, IoBuffer buffer, int secCnt) {
+    int stripeSectors = raid.chunkSectors * (raid.dev.m_Devices - 1);
+    int batchStripes = max(1, BATCH_SECTORS / stripeSectors);
+    TSector maxSec = secNr + secCnt;
+
+    // Plan and write a window of whole stripes at a time
+    for (int done = 0; secNr < maxSec && (raid.state == RAID_OK || raid.state == RAID_DEGRADED);) {
+        int count = (int) (min(maxSec, (secNr / stripeSectors + batchStripes) * stripeSectors) - secNr);
+        unsigned errors = memberErrors;
+        if (!writeRange(secNr, buffer.from(done), count)) {
+            if (memberErrors == errors)
+                return false; // no member failed, the same window would fail again
+            continue; // state changed, replan the window in the new state
+        }
+        secNr += count;
+        done += count;
+
+        // Memory pressure: dirty rows must be written before they can be evicted
+        if (cache && !cache->evict()) {
+            flushCache();
+            cache->evict();
         }
     }
 
@@ -275,154 +935,1081 @@ bool CRaidVolume::read(int secNr, void *data, int secCnt) {
     return true;
 }
 
-// Write RAID sectors with parity updates
-bool CRaidVolume::write(int secNr, const void *data, int secCnt) {
-    Evaluation res{};
-    unsigned char previous[SECTOR_SIZE], parity[SECTOR_SIZE], input[SECTOR_SIZE];
-    const unsigned char *dataPtr = (unsigned char *) data;
-    int maxSec = secNr + secCnt;
+// Queue an asynchronous read
+bool CRaidVolume::submitRead(TSector secNr, void *data, int secCnt, unsigned long long tag,
+                             function<void(bool)> callback) {
+    return submit(secNr, (unsigned char *) data, secCnt, false, tag, move(callback));
+}
 
-    if (raid.state == RAID_OK) {
-        for (; secNr < maxSec; secNr++, dataPtr += SECTOR_SIZE) {
-            res = findSector(secNr);
+// Queue an asynchronous write
+bool CRaidVolume::submitWrite(TSector secNr, const void *data, int secCnt, unsigned long long tag,
+                              function<void(bool)> callback) {
+    return submit(secNr, (unsigned char *) data, secCnt, true, tag, move(callback));
+}
 
-            // Read previous data
-            if (!myRead(res.disk, res.sector, previous))
-                break;
+int CRaidVolume::reap(TRaidCompletion *completions, int maxCnt, int minCnt) {
+    shared_lock<shared_timed_mutex> running(runLock);
+    return asyncQueue ? asyncQueue->reap(completions, maxCnt, minCnt) : 0;
+}
 
-            // Read data from parity disc
-            if (!myRead(res.diskParity, res.sector, parity))
-                break;
+void CRaidVolume::setQueueDepth(int depth) {
+    queueDepth = depth;
+}
 
-            // XOR parity disc with previous data
-            for (int byteNumber = 0; byteNumber < SECTOR_SIZE; ++byteNumber)
-                parity[byteNumber] ^= previous[byteNumber];
+void CRaidVolume::setResyncCheckpoint(int sectors) {
+    resyncCheckpoint = max(1, sectors);
+}
 
-            // Get input data
-            memcpy(input, dataPtr, SECTOR_SIZE);
+void CRaidVolume::setCacheSize(size_t bytes) {
+    cacheSize = bytes;
+}
 
-            // XOR parity disc with new data
-            for (int byteNumber = 0; byteNumber < SECTOR_SIZE; ++byteNumber)
-                parity[byteNumber] ^= input[byteNumber];
+TCacheStats CRaidVolume::cacheStats() const {
+    return cache ? cache->stats() : TCacheStats();
+}
 
-            // Write new parity
-            if (!myWrite(res.diskParity, res.sector, parity))
-                break;
+void CRaidVolume::setReadAhead(size_t bytes) {
+    readAheadSize = bytes;
+}
 
-            // Write new data
-            if (!myWrite(res.disk, res.sector, dataPtr))
-                break;
+TReadAheadStats CRaidVolume::readAheadStats() const {
+    return readAhead ? readAhead->stats() : TReadAheadStats();
+}
+
+void CRaidVolume::setLogMapCache(size_t bytes) {
+    logMapCache = bytes;
+}
+
+TLogStats CRaidVolume::logStats() const {
+    shared_lock<shared_timed_mutex> running(runLock);
+    return logStore ? logStore->stats() : TLogStats();
+}
+
+TRaidStats CRaidVolume::stats() const {
+    TRaidStats snapshot = statistics.snapshot();
+    snapshot.devices = raid.dev.m_Devices;
+    if (raid.state == RAID_DEGRADED) {
+        snapshot.resyncSector = raid.resyncSector;
+        snapshot.resyncTotal = stripeCount() * raid.chunkSectors;
+        snapshot.resyncRate = resyncRunning ? statistics.resyncRate(snapshot.resyncSector) : 0;
+    }
+    if (scrubRunning) {
+        snapshot.scrubSector = raid.scrubSector;
+        snapshot.scrubTotal = stripeCount() * raid.chunkSectors;
+    }
+    // A member whose tail latency is far above the typical member is flagged
+    double percentile = hedgePercentile > 0 ? hedgePercentile.load() : DEFAULT_SLOW_PERCENTILE;
+    unsigned long long typical = typicalLatency(percentile);
+    for (int disk = 0; disk < raid.dev.m_Devices && typical; disk++)
+        snapshot.disks[disk].slow = statistics.latencyPercentile(disk, percentile) > typical * SLOW_DISK_FACTOR;
+
+    // Not worth waiting for a start or stop in progress
+    shared_lock<shared_timed_mutex> running(runLock, try_to_lock);
+    snapshot.clientsIdle = running && scheduler && scheduler->idle();
+    snapshot.mappedStripes = running && allocation ? allocation->mappedCount() : stripeCount();
+    return snapshot;
+}
+
+void CRaidVolume::resetStats() {
+    statistics.reset();
+}
+
+// Write the open log segment and dirty cached rows to the disks
+bool CRaidVolume::flush() {
+    shared_lock<shared_timed_mutex> running;
+    return enter(running) && (!logStore || logStore->flush()) && flushCache();
+}
+
+// Release whole stripes of a range: persisted as released first, then discarded on the members
+bool CRaidVolume::discard(TSector secNr, TSector secCnt) {
+    shared_lock<shared_timed_mutex> running;
+    if (!enter(running) || !allocation || logStore || !inRange(secNr, secCnt))
+        return false;
+    if (raid.state != RAID_OK && raid.state != RAID_DEGRADED)
+        return false;
+
+    int chunk = raid.chunkSectors;
+    int stripeSectors = stripeMap.stripeSectors();
+    TSector firstStripe = (secNr + stripeSectors - 1) / stripeSectors;
+    TSector lastStripe = (secNr + secCnt) / stripeSectors;
+    if (firstStripe >= lastStripe)
+        return true;
+
+    CRangeGuard stripeGuard(stripeLocks, firstStripe, lastStripe, true);
+
+    // No write-back of these rows may be in progress or follow, the stripe is zeroed when reused.
+    // Dirty rows are dropped: the whole stripe is released. Done before the rows are locked,
+    // write-back locks rows itself.
+    if (cache) {
+        lock_guard<mutex> guard(flushLock);
+        cache->discard(firstStripe * chunk, lastStripe * chunk);
+    }
+    CRangeGuard rowGuard(rowLocks, firstStripe * chunk, lastStripe * chunk, false);
+    if (readAhead)
+        readAhead->invalidate(firstStripe * stripeSectors, lastStripe * stripeSectors);
+    saveAllocation(allocation->unmap(firstStripe, lastStripe));
+
+    // On the disk workers like all member I/O of a running RAID
+    if (raid.dev.m_Discard) {
+        int failedDisk = raid.failedDisk;
+        const TBlkDev &dev = raid.dev;
+        TSector first = firstStripe * chunk;
+        TSector count = (lastStripe - firstStripe) * chunk;
+        CCompletion completion(dev.m_Devices - (failedDisk != NO_DISK));
+        for (int disk = 0; disk < dev.m_Devices; disk++)
+            if (disk != failedDisk)
+                scheduler->submit(disk, IO_FOREGROUND, 0, [&dev, &completion, disk, first, count]
+                        (CIoScheduler::Clock::duration, bool) {
+                    dev.m_Discard(disk, first, count);
+                    completion.done();
+                });
+        completion.wait();
+    }
+    return raid.state == RAID_OK || raid.state == RAID_DEGRADED;
+}
+
+// --- Private helper functions ---
+
+// Hold the RAID running for a request, fails while stop() is waiting for requests in progress
+bool CRaidVolume::enter(shared_lock<shared_timed_mutex> &running) {
+    if (stopping)
+        return false;
+    running = shared_lock<shared_timed_mutex>(runLock);
+    return true;
+}
+
+// Requests must lie within the volume, sectors past it hold the maps and the overhead
+bool CRaidVolume::inRange(TSector secNr, TSector secCnt) const {
+    return secNr >= 0 && secCnt >= 0 && secNr + secCnt <= size();
+}
+
+// Write back dirty cached rows, the caller keeps the RAID running
+bool CRaidVolume::flushCache() {
+    if (cache) {
+        lock_guard<mutex> guard(flushLock);
+        int devices = raid.dev.m_Devices;
+        vector<TSector> rows;
+        vector<uint32_t> masks;
+        vector<unsigned char> sectors;
+
+        while (cache->collect(rows, masks, sectors, BATCH_SECTORS) > 0) {
+            CRangeGuard rowGuard(rowLocks, *min_element(rows.begin(), rows.end()),
+                                 *max_element(rows.begin(), rows.end()) + 1, false);
+            int failedDisk = degradedDisk();
+            vector<SectorIo> writes;
+            for (size_t r = 0; r < rows.size(); r++)
+                for (int disk = 0; disk < devices; disk++)
+                    if ((masks[r] >> disk & 1) && disk != failedDiskAt(rows[r], failedDisk))
+                        writes.push_back({disk, rows[r], &sectors[(r * devices + disk) * SECTOR_SIZE]});
+
+            long long version = 0;
+            if (bitmap)
+                for (TSector row : rows)
+                    version = max(version, bitmap->begin(row, row + 1));
+            if (version)
+                saveBitmap(version);
+            writeBatch(writes);
+            if (bitmap)
+                for (TSector row : rows)
+                    bitmap->end(row, row + 1);
+            cache->release(rows);
         }
     }
 
-    if (raid.state == RAID_DEGRADED) {
-        for (; secNr < maxSec; secNr++, dataPtr += SECTOR_SIZE) {
-            res = findSector(secNr);
-
-            if (res.diskParity == raid.failedDisk) {
-                // Parity disk is invalid => just write new data to appropriate disk
-                if (!myWrite(res.disk, res.sector, dataPtr))
-                    break;
-                else
-                    continue;
+    return raid.state == RAID_OK || raid.state == RAID_DEGRADED;
+}
+
+// Start an asynchronous read on the disk schedulers, it completes from their workers and holds no
+// thread meanwhile. False if the read takes the blocking path: cache, log, allocation map, read-ahead,
+// hedged reads or a failed disk. A member error hands the read to the blocking path, which records it.
+bool CRaidVolume::startRead(TSector secNr, unsigned char *data, int secCnt, const CAsyncQueue::Finish &finish) {
+    if (cache || logStore || allocation || readAhead || hedgePercentile > 0 || raid.state != RAID_OK)
+        return false;
+
+    int stripeSectors = stripeMap.stripeSectors();
+    int handle = stripeLocks.lock(secNr / stripeSectors, (secNr + secCnt - 1) / stripeSectors + 1, false);
+    if (raid.state != RAID_OK) {
+        stripeLocks.unlock(handle);
+        return false;
+    }
+
+    // Everything the I/O in flight refers to, released by the last run
+    struct Read {
+        vector<SectorIo> batch;
+        vector<DiskRun> runs;
+        vector<size_t> ends;
+        vector<unsigned char> staging;
+        unique_ptr<CCompletion> completion;
+    };
+    auto read = make_shared<Read>();
+    stripeMap.forEach(secNr, secCnt, [&](const TStripeSegment &segment) {
+        for (int j = 0; j < segment.count; j++)
+            read->batch.push_back({segment.disk, segment.sector + j, data + (size_t) (segment.offset + j) * SECTOR_SIZE});
+    });
+    coalesce(read->batch, false, read->runs, read->ends, read->staging);
+
+    read->completion.reset(new CCompletion((int) read->runs.size(), [this, read, handle, finish, secCnt] {
+        bool valid = true;
+        for (const DiskRun &run : read->runs)
+            valid &= run.done;
+        if (valid) {
+            scatter(read->batch, read->runs, read->ends);
+            statistics.request(false, secCnt);
+        }
+        stripeLocks.unlock(handle);
+        finish(valid, !valid);
+    }));
+    startRuns(read->runs, false, *read->completion);
+    return true;
+}
+
+// Order a request by the stripes it touches and hand it to the asynchronous queue
+bool CRaidVolume::submit(TSector secNr, unsigned char *data, int secCnt, bool isWrite, unsigned long long tag,
+                         function<void(bool)> callback) {
+    shared_lock<shared_timed_mutex> running;
+    if (!enter(running) || !asyncQueue || secCnt <= 0 || !inRange(secNr, secCnt) || (raid.state != RAID_OK && raid.state != RAID_DEGRADED))
+        return false;
+
+    // Runs on a queue worker, stop() drains the queue before it stops the RAID
+    int stripeSectors = raid.chunkSectors * (raid.dev.m_Devices - 1);
+    auto operation = [this, secNr, data, secCnt, isWrite] {
+        return isWrite ? writeSectors(secNr, {data, nullptr}, secCnt) : readSectors(secNr, {data, nullptr}, secCnt);
+    };
+    auto start = [this, secNr, data, secCnt](const CAsyncQueue::Finish &finish) {
+        return startRead(secNr, data, secCnt, finish);
+    };
+    return asyncQueue->submit(secNr / stripeSectors, (secNr + secCnt - 1) / stripeSectors, isWrite,
+                              isWrite ? CAsyncQueue::Start() : CAsyncQueue::Start(start), operation,
+                              move(callback), tag);
+}
+
+// Read a range with one batch; sectors of a failed disk are evaluated from remaining disks.
+// Data of the same parity row requested by the caller is read once and reused as a source.
+bool CRaidVolume::readRange(TSector secNr, IoBuffer data, int secCnt) {
+    int devices = raid.dev.m_Devices;
+    int dataDisks = devices - 1;
+    int chunk = raid.chunkSectors;
+    int stripeSectors = chunk * dataDisks;
+
+    // Writers of these stripes wait, a degraded read must not see parity and data of different writes
+    CRangeGuard stripeGuard(stripeLocks, secNr / stripeSectors, (secNr + secCnt - 1) / stripeSectors + 1, false);
+    int failedDisk = degradedDisk();
+    vector<SectorIo> batch;
+    vector<TStripeSegment> lost; // single sectors to evaluate
+    vector<unsigned char> loaded;
+
+    // Serve cached sectors and read the others directly into caller memory;
+    // the failed disk is read directly where resync has already rebuilt it
+    stripeMap.forEach(secNr, secCnt, [&](const TStripeSegment &segment) {
+        if (allocation && !allocation->mapped(segment.stripe)) {
+            // Released stripe: zeros without I/O
+            for (int j = 0; j < segment.count; j++)
+                memset(data.at(segment.offset + j), 0, SECTOR_SIZE);
+            return;
+        }
+        for (int j = 0; j < segment.count; j++) {
+            int i = segment.offset + j;
+            TSector sector = segment.sector + j;
+            if (cache && cache->read(sector, segment.disk, data.at(i)))
+                continue;
+            if (segment.disk == failedDiskAt(sector, failedDisk))
+                lost.push_back({i, segment.disk, sector, 1, segment.diskParity, segment.stripe});
+            else
+                batch.push_back({segment.disk, sector, data.at(i)});
+        }
+    });
+
+    // Sources of each lost sector: caller memory if requested, otherwise loaded from the disk
+    vector<const unsigned char *> sources(lost.size() * dataDisks);
+    loaded.resize(lost.size() * dataDisks * SECTOR_SIZE);
+    unsigned char *next = loaded.data();
+    for (size_t l = 0; l < lost.size(); l++) {
+        const TStripeSegment &res = lost[l];
+        int lostIdx = res.disk > res.diskParity ? res.disk - 1 : res.disk;
+        const unsigned char **src = &sources[l * dataDisks];
+
+        for (int i = 0; i < dataDisks; i++) {
+            if (i == lostIdx)
+                continue;
+            int offset = res.offset + (i - lostIdx) * chunk;
+            if (offset >= 0 && offset < secCnt) {
+                *src++ = data.at(offset);
+                continue;
             }
+            batch.push_back({i >= res.diskParity ? i + 1 : i, res.sector, next});
+            *src++ = next;
+            next += SECTOR_SIZE;
+        }
+        batch.push_back({res.diskParity, res.sector, next});
+        *src = next;
+        next += SECTOR_SIZE;
+    }
 
-            if (res.disk == raid.failedDisk) {
-                // Get previous data from remaining disks
-                unsigned char tmp[SECTOR_SIZE];
+    if (!readBatch(batch))
+        return false;
+
+    // Evaluate data of broken disk
+    for (size_t l = 0; l < lost.size(); l++)
+        xorParity(data.at(lost[l].offset), &sources[l * dataDisks], dataDisks, SECTOR_SIZE);
+    statistics.reconstructed((int) lost.size());
 
-                // Get disk parity
-                if (!myRead(res.diskParity, res.sector, previous))
-                    break;
+    return true;
+}
 
-                // XOR parity with remaining disks
-                for (int i = 0; i < raid.dev.m_Devices; i++) {
-                    if (i != raid.failedDisk && i != res.diskParity) {
-                        // Get data from other disk
-                        if (!myRead(i, res.sector, tmp))
-                            return false;
+// Choose the cheapest way to update parity of a partially or fully written row
+CRaidVolume::WritePlan CRaidVolume::planRow(int diskParity, int first, int count, int failedDisk) const {
+    int dataDisks = raid.dev.m_Devices - 1;
 
-                        // XOR it with parity
-                        for (int byteNumber = 0; byteNumber < SECTOR_SIZE; ++byteNumber)
-                            previous[byteNumber] ^= tmp[byteNumber];
-                    }
-                }
-            } else {
-                // Read previous data
-                if (!myRead(res.disk, res.sector, previous))
-                    break;
+    if (failedDisk != NO_DISK) {
+        // Parity disk is invalid => just write new data
+        if (failedDisk == diskParity)
+            return WRITE_DATA_ONLY;
+
+        // Old data of a written failed disk is unknown => parity from scratch
+        int failedIdx = failedDisk > diskParity ? failedDisk - 1 : failedDisk;
+        if (failedIdx >= first && failedIdx < first + count)
+            return WRITE_RECONSTRUCT;
+
+        // Untouched failed disk cannot be read => update parity in place
+        return WRITE_READ_MODIFY;
+    }
+
+    // Both plans write the same sectors, compare reads:
+    // read-modify-write reads old data and parity, reconstruct-write reads untouched data
+    int rmwReads = count + 1;
+    int rcwReads = dataDisks - count;
+    return rcwReads < rmwReads ? WRITE_RECONSTRUCT : WRITE_READ_MODIFY;
+}
+
+// Split a range into parity rows: the same physical sector of all disks.
+// Written data disks of a row are consecutive.
+vector<CRaidVolume::WriteRow> CRaidVolume::planRows(TSector secNr, int secCnt, int failedDisk) const {
+    int devices = raid.dev.m_Devices;
+    int chunk = raid.chunkSectors;
+    int stripeSectors = chunk * (devices - 1);
+    TSector maxSec = secNr + secCnt;
+    vector<WriteRow> rows;
+
+    for (TSector stripe = secNr / stripeSectors; stripe * stripeSectors < maxSec; stripe++) {
+        int low = (int) max<TSector>(secNr - stripe * stripeSectors, 0);
+        int high = (int) min<TSector>(maxSec - stripe * stripeSectors, stripeSectors);
+        for (int offset = 0; offset < chunk; offset++) {
+            int first = low <= offset ? 0 : (low - offset + chunk - 1) / chunk;
+            int last = high - 1 < offset ? -1 : (high - 1 - offset) / chunk;
+            int rowFailed = failedDiskAt(stripe * chunk + offset, failedDisk);
+            if (first <= last)
+                rows.push_back({stripe, offset, first, last - first + 1,
+                                planRow((int) (stripe % devices), first, last - first + 1, rowFailed), rowFailed});
+        }
+    }
+
+    return rows;
+}
+
+// Write a range of stripes: plan each parity row, then batch all reads and all writes
+bool CRaidVolume::writeRange(TSector secNr, IoBuffer data, int secCnt) {
+    int devices = raid.dev.m_Devices;
+    int dataDisks = devices - 1;
+    int chunk = raid.chunkSectors;
+    int stripeSectors = chunk * dataDisks;
+
+    // Stripes are written by one request at a time; rows stay out of a resync batch
+    // while planned against the watermark and written
+    TSector firstStripe = secNr / stripeSectors;
+    TSector lastStripe = (secNr + secCnt - 1) / stripeSectors + 1;
+    TSector firstRow = firstStripe * chunk;
+    TSector lastRow = lastStripe * chunk;
+    CRangeGuard stripeGuard(stripeLocks, firstStripe, lastStripe, true);
+    CRangeGuard rowGuard(rowLocks, firstRow, lastRow, false);
+    int failedDisk = degradedDisk();
+    if (allocation)
+        allocate(secNr, secCnt, firstStripe, lastStripe, failedDisk);
+
+    vector<WriteRow> rows = planRows(secNr, secCnt, failedDisk);
+    if (cache)
+        return writeCached(secNr, data, rows, failedDisk);
+
+    // Per row: slot for old data of each data disk, last slot for parity
+    vector<unsigned char> scratch(rows.size() * devices * SECTOR_SIZE);
+    vector<SectorIo> reads, writes;
+    auto slot = [&](size_t r, int i) { return &scratch[(r * devices + i) * SECTOR_SIZE]; };
+    auto input = [&](const WriteRow &row, int i) {
+        return data.at(row.stripe * stripeSectors + i * chunk + row.offset - secNr);
+    };
+
+    // Collect reads required by the plan of each row
+    for (size_t r = 0; r < rows.size(); r++) {
+        const WriteRow &row = rows[r];
+        int diskParity = (int) (row.stripe % devices);
+        TSector sector = row.stripe * chunk + row.offset;
+
+        for (int i = 0; i < dataDisks; i++) {
+            bool written = i >= row.first && i < row.first + row.count;
+            if ((row.plan == WRITE_RECONSTRUCT && !written) || (row.plan == WRITE_READ_MODIFY && written))
+                reads.push_back({i >= diskParity ? i + 1 : i, sector, slot(r, i)});
+        }
+        if (row.plan == WRITE_READ_MODIFY)
+            reads.push_back({diskParity, sector, slot(r, dataDisks)});
+    }
+
+    if (!readBatch(reads))
+        return false;
+
+    // Evaluate new parity of each row and collect writes
+    int planned[3] = {0, 0, 0};
+    int fullRows = 0;
+    for (size_t r = 0; r < rows.size(); r++) {
+        const WriteRow &row = rows[r];
+        planned[row.plan]++;
+        if (row.plan == WRITE_RECONSTRUCT && row.count == dataDisks)
+            fullRows++;
+        int diskParity = (int) (row.stripe % devices);
+        TSector sector = row.stripe * chunk + row.offset;
+        unsigned char *parity = slot(r, dataDisks);
+        const unsigned char *src[2 * MAX_RAID_DEVICES];
+        int srcCnt = 0;
+
+        if (row.plan == WRITE_RECONSTRUCT) {
+            // Parity from new data and untouched data on remaining disks
+            for (int i = 0; i < dataDisks; i++)
+                src[srcCnt++] = i >= row.first && i < row.first + row.count ? input(row, i) : slot(r, i);
+            xorParity(parity, src, srcCnt, SECTOR_SIZE);
+        } else if (row.plan == WRITE_READ_MODIFY) {
+            // XOR parity with previous and new data of each written disk
+            for (int i = row.first; i < row.first + row.count; i++) {
+                src[srcCnt++] = slot(r, i);
+                src[srcCnt++] = input(row, i);
             }
+            xorBlocks(parity, src, srcCnt, SECTOR_SIZE);
+        }
 
-            // Read data from parity disc
-            if (!myRead(res.diskParity, res.sector, parity))
-                break;
+        // Write new parity and new data, skip failed disk in degraded mode
+        if (row.plan != WRITE_DATA_ONLY && diskParity != row.failedDisk)
+            writes.push_back({diskParity, sector, parity});
+        for (int i = row.first; i < row.first + row.count; i++) {
+            int disk = i >= diskParity ? i + 1 : i;
+            if (disk != row.failedDisk)
+                writes.push_back({disk, sector, input(row, i)});
+        }
+    }
+
+    // A failed disk does not stop writes to the others: every row then stays
+    // consistent with the new data in degraded mode, no replanning needed
+    if (bitmap)
+        saveBitmap(bitmap->begin(firstRow, lastRow));
+    writeBatch(writes);
+    if (bitmap)
+        bitmap->end(firstRow, lastRow);
+    statistics.rows(fullRows, planned[WRITE_RECONSTRUCT] - fullRows, planned[WRITE_READ_MODIFY],
+                    planned[WRITE_DATA_ONLY]);
+    return true;
+}
+
+// Released stripes among [firstStripe, lastStripe) about to be written: zeros on the disks where the
+// write does not cover the whole stripe, then recorded as allocated before any data lands
+void CRaidVolume::allocate(TSector secNr, int secCnt, TSector firstStripe, TSector lastStripe, int failedDisk) {
+    vector<TSector> released = allocation->released(firstStripe, lastStripe);
+    if (released.empty())
+        return;
+
+    int devices = raid.dev.m_Devices;
+    int chunk = raid.chunkSectors;
+    int stripeSectors = stripeMap.stripeSectors();
+    vector<unsigned char> zeros((size_t) chunk * SECTOR_SIZE);
+    vector<SectorIo> writes;
+    for (TSector stripe : released) {
+        if (secNr <= stripe * stripeSectors && (stripe + 1) * stripeSectors <= secNr + secCnt)
+            continue;
+        for (int i = 0; i < chunk; i++) {
+            TSector row = stripe * chunk + i;
+            for (int disk = 0; disk < devices; disk++)
+                if (disk != failedDiskAt(row, failedDisk))
+                    writes.push_back({disk, row, &zeros[(size_t) i * SECTOR_SIZE]});
+        }
+    }
+    writeBatch(writes);
+    saveAllocation(allocation->map(released));
+}
+
+// Write rows into the stripe cache; rows missing in the cache are loaded first
+bool CRaidVolume::writeCached(TSector secNr, IoBuffer data, const vector<WriteRow> &rows, int failedDisk) {
+    int devices = raid.dev.m_Devices;
+    int dataDisks = devices - 1;
+    int stripeSectors = raid.chunkSectors * dataDisks;
+    auto input = [&](const WriteRow &row, int i) {
+        return data.at(row.stripe * stripeSectors + i * raid.chunkSectors + row.offset - secNr);
+    };
+    vector<size_t> misses;
+
+    // Cached rows: data and parity updated in memory
+    for (size_t r = 0; r < rows.size(); r++) {
+        const WriteRow &row = rows[r];
+        int diskParity = (int) (row.stripe % devices);
+        int disks[MAX_RAID_DEVICES];
+        const unsigned char *src[MAX_RAID_DEVICES];
+        for (int i = 0; i < row.count; i++) {
+            disks[i] = row.first + i >= diskParity ? row.first + i + 1 : row.first + i;
+            src[i] = input(row, row.first + i);
+        }
+        if (!cache->write(row.stripe * raid.chunkSectors + row.offset, diskParity, disks, src, row.count))
+            misses.push_back(r);
+    }
+
+    // Load partially written missing rows: all disks except one, whose sector is evaluated
+    vector<unsigned char> loaded(misses.size() * devices * SECTOR_SIZE);
+    vector<SectorIo> reads;
+    for (size_t m = 0; m < misses.size(); m++) {
+        const WriteRow &row = rows[misses[m]];
+        int skip = failedDisk != NO_DISK ? failedDisk : (int) (row.stripe % devices);
+        if (row.count == dataDisks)
+            continue;
+        for (int disk = 0; disk < devices; disk++)
+            if (disk != skip)
+                reads.push_back({disk, row.stripe * raid.chunkSectors + row.offset,
+                                 &loaded[(m * devices + disk) * SECTOR_SIZE]});
+    }
+
+    if (!readBatch(reads))
+        return false;
+
+    for (size_t m = 0; m < misses.size(); m++) {
+        const WriteRow &row = rows[misses[m]];
+        int diskParity = (int) (row.stripe % devices);
+        int skip = failedDisk != NO_DISK ? failedDisk : diskParity;
+        unsigned char *sectors = &loaded[m * devices * SECTOR_SIZE];
+        const unsigned char *src[MAX_RAID_DEVICES];
+        int srcCnt = 0;
+        uint32_t dirty = 1u << diskParity;
+
+        // Evaluate the skipped sector from the others
+        if (row.count != dataDisks) {
+            for (int disk = 0; disk < devices; disk++)
+                if (disk != skip)
+                    src[srcCnt++] = sectors + disk * SECTOR_SIZE;
+            xorParity(sectors + skip * SECTOR_SIZE, src, srcCnt, SECTOR_SIZE);
+        }
+
+        // Apply new data and evaluate parity of the complete row
+        srcCnt = 0;
+        for (int i = 0; i < dataDisks; i++) {
+            int disk = i >= diskParity ? i + 1 : i;
+            if (i >= row.first && i < row.first + row.count) {
+                memcpy(sectors + disk * SECTOR_SIZE, input(row, i), SECTOR_SIZE);
+                dirty |= 1u << disk;
+            }
+            src[srcCnt++] = sectors + disk * SECTOR_SIZE;
+        }
+        xorParity(sectors + diskParity * SECTOR_SIZE, src, srcCnt, SECTOR_SIZE);
+        cache->insert(row.stripe * raid.chunkSectors + row.offset, sectors, dirty);
+    }
+
+    return true;
+}
+
+// Number of whole stripes in front of the allocation map, bitmap and overhead sectors
+TSector CRaidVolume::stripeCount() const {
+    return (raid.dev.m_Sectors - 1 - raid.bitmapSectors - raid.allocSectors) / raid.chunkSectors;
+}
+
+// Overhead describing the running RAID
+Overhead CRaidVolume::currentOverhead() const {
+    return Overhead{raid.state.load(), raid.failedDisk.load(), raid.timestamp, raid.chunkSectors, raid.resyncSector.load(),
+                    raid.bitmapSectors, raid.regionSectors, raid.scrubSector.load(), raid.allocSectors,
+                    raid.logId, raid.volumeId};
+}
+
+// Read a batch, any failed disk fails the batch
+bool CRaidVolume::readBatch(vector<SectorIo> &batch, int ioClass) {
+    return transferBatch(batch, false, ioClass);
+}
 
-            // XOR parity disc with previous data
-            for (int byteNumber = 0; byteNumber < SECTOR_SIZE; ++byteNumber)
-                parity[byteNumber] ^= previous[byteNumber];
+// Write a batch, failed disks are tracked and writes to the other disks still complete
+bool CRaidVolume::writeBatch(vector<SectorIo> &batch, int ioClass) {
+    return transferBatch(batch, true, ioClass);
+}
 
-            // Get input data
-            memcpy(input, dataPtr, SECTOR_SIZE);
+// Sort a batch by disk and sector and issue each run of neighbouring sectors as one call
+bool CRaidVolume::transferBatch(vector<SectorIo> &batch, bool isWrite, int ioClass) {
+    vector<DiskRun> runs;
+    vector<size_t> ends;
+    vector<unsigned char> staging;
+    coalesce(batch, isWrite, runs, ends, staging);
 
-            // XOR parity disc with new data
-            for (int byteNumber = 0; byteNumber < SECTOR_SIZE; ++byteNumber)
-                parity[byteNumber] ^= input[byteNumber];
+    bool valid = transferRuns(runs, isWrite, ioClass);
+    if (!isWrite && valid)
+        scatter(batch, runs, ends);
+    return valid;
+}
 
-            // Write new parity
-            if (!myWrite(res.diskParity, res.sector, parity))
+// Runs of neighbouring sectors of a sorted batch, 'ends' holds the batch index after the last
+// sector of each run. Runs scattered in caller memory go through 'staging', filled for writes.
+void CRaidVolume::coalesce(vector<SectorIo> &batch, bool isWrite, vector<DiskRun> &runs, vector<size_t> &ends,
+                           vector<unsigned char> &staging) {
+    sort(batch.begin(), batch.end(), [](const SectorIo &a, const SectorIo &b) {
+        return a.disk != b.disk ? a.disk < b.disk : a.sector < b.sector;
+    });
+
+    // Reads may bridge small gaps, the skipped sectors are simply discarded
+    int maxGap = isWrite ? 0 : COALESCE_GAP;
+    size_t stagingSectors = 0;
+
+    for (size_t begin = 0, end; begin < batch.size(); begin = end) {
+        int disk = batch[begin].disk;
+        TSector first = batch[begin].sector;
+        bool direct = true; // consecutive sectors in consecutive memory
+
+        for (end = begin + 1; end < batch.size() && batch[end].disk == disk; end++) {
+            TSector gap = batch[end].sector - batch[end - 1].sector - 1;
+            if (gap > maxGap || batch[end].sector - first >= MAX_RUN_SECTORS)
                 break;
+            if (gap != 0 || batch[end].data != batch[end - 1].data + SECTOR_SIZE)
+                direct = false;
+        }
+
+        int count = (int) (batch[end - 1].sector - first + 1);
+        runs.push_back({disk, first, count, direct ? batch[begin].data : nullptr, false});
+        ends.push_back(end);
+        if (!direct)
+            stagingSectors += count;
+    }
+
+    staging.resize(stagingSectors * SECTOR_SIZE);
+    unsigned char *next = staging.data();
+    for (size_t r = 0, begin = 0; r < runs.size(); begin = ends[r++]) {
+        if (runs[r].data)
+            continue;
+        runs[r].data = next;
+        next += (size_t) runs[r].count * SECTOR_SIZE;
+        if (isWrite)
+            for (size_t i = begin; i < ends[r]; i++)
+                memcpy(runs[r].data + (size_t) (batch[i].sector - runs[r].sector) * SECTOR_SIZE, batch[i].data, SECTOR_SIZE);
+    }
+}
+
+// Copy staged reads of a coalesced batch to caller memory
+void CRaidVolume::scatter(const vector<SectorIo> &batch, const vector<DiskRun> &runs, const vector<size_t> &ends) {
+    for (size_t r = 0, begin = 0; r < runs.size(); begin = ends[r++])
+        for (size_t i = begin; i < ends[r]; i++) {
+            const unsigned char *src = runs[r].data + (size_t) (batch[i].sector - runs[r].sector) * SECTOR_SIZE;
+            if (src != batch[i].data)
+                memcpy(batch[i].data, src, SECTOR_SIZE);
+        }
+}
+
+// Fan runs out to the disk workers, join, then update RAID state for failed disks
+bool CRaidVolume::transferRuns(vector<DiskRun> &runs, bool isWrite, int ioClass) {
+    if (!isWrite && ioClass == IO_FOREGROUND && hedgePercentile > 0 && raid.state == RAID_OK && !cache)
+        return readHedged(runs);
+    CCompletion completion((int) runs.size());
+    startRuns(runs, isWrite, completion, ioClass);
+    completion.wait();
+    return finishRuns(runs);
+}
 
-            // Write new data
-            if (res.disk != raid.failedDisk) {
-                if (!myWrite(res.disk, res.sector, dataPtr))
-                    break;
+// Fan runs out to the disk workers without waiting, 'completion' counts runs.size() operations
+void CRaidVolume::startRuns(vector<DiskRun> &runs, bool isWrite, CCompletion &completion, int ioClass) {
+    const TBlkDev &dev = raid.dev;
+    CRaidStats &counters = statistics;
+    for (DiskRun &run : runs) {
+        size_t bytes = (size_t) run.count * SECTOR_SIZE;
+        scheduler->submit(run.disk, ioClass, bytes, [&run, &completion, &dev, &counters, isWrite, ioClass, bytes]
+                (CIoScheduler::Clock::duration wait, bool late) {
+            counters.dispatched(ioClass, bytes, wait, late);
+            auto begin = chrono::steady_clock::now();
+            run.done = isWrite ? dev.m_Write(run.disk, run.sector, run.data, run.count)
+                               : dev.m_Read(run.disk, run.sector, run.data, run.count);
+            counters.diskIo(run.disk, isWrite, run.count, run.done, chrono::steady_clock::now() - begin);
+            completion.done();
+        });
+    }
+}
+
+// Read runs through private buffers; runs of one disk still missing at the hedge deadline are also
+// evaluated from the same rows of all other disks and the first complete result is used.
+// Reads that lose finish later into the buffers they share with the others. Helper reads are
+// waited for, a failed one fails its disk like the runs do.
+bool CRaidVolume::readHedged(vector<DiskRun> &runs) {
+    enum { PENDING, READ, FAILED };
+    struct Hedge {
+        mutex lock;
+        condition_variable cv;
+        vector<unique_ptr<unsigned char[]>> buffers;
+        vector<int> state;
+        vector<int> disks;
+    };
+    auto hedge = make_shared<Hedge>();
+    const TBlkDev &dev = raid.dev;
+    CRaidStats &counters = statistics;
+    auto issue = [&](int disk, TSector sector, int count) {
+        size_t bytes = (size_t) count * SECTOR_SIZE;
+        unsigned char *data = new unsigned char[bytes];
+        size_t index;
+        {
+            lock_guard<mutex> guard(hedge->lock);
+            index = hedge->buffers.size();
+            hedge->buffers.emplace_back(data);
+            hedge->state.push_back(PENDING);
+            hedge->disks.push_back(disk);
+        }
+        scheduler->submit(disk, IO_FOREGROUND, bytes, [hedge, index, data, disk, sector, count, bytes, &dev, &counters]
+                (CIoScheduler::Clock::duration wait, bool late) {
+            counters.dispatched(IO_FOREGROUND, bytes, wait, late);
+            auto begin = chrono::steady_clock::now();
+            bool done = dev.m_Read(disk, sector, data, count);
+            counters.diskIo(disk, false, count, done, chrono::steady_clock::now() - begin);
+            lock_guard<mutex> guard(hedge->lock);
+            hedge->state[index] = done ? READ : FAILED;
+            hedge->cv.notify_all();
+        });
+    };
+
+    size_t runCnt = runs.size();
+    for (const DiskRun &run : runs)
+        issue(run.disk, run.sector, run.count);
+    auto deadline = chrono::steady_clock::now()
+                    + chrono::microseconds(max<unsigned long long>(hedgeMinDeadline, typicalLatency(hedgePercentile)));
+
+    unique_lock<mutex> guard(hedge->lock);
+    auto finished = [&](size_t r) { return hedge->state[r] != PENDING; };
+    auto allFinished = [&] {
+        for (size_t r = 0; r < runCnt; r++)
+            if (!finished(r))
+                return false;
+        return true;
+    };
+
+    // The other disks read the rows of a late run, only one late disk can be evaluated around
+    int devices = dev.m_Devices;
+    int slowDisk = NO_DISK;
+    vector<size_t> helpers(runCnt, 0); // index of the first read evaluating a run
+    if (!hedge->cv.wait_until(guard, deadline, allFinished)) {
+        for (size_t r = 0; r < runCnt; r++)
+            if (!finished(r))
+                slowDisk = slowDisk == NO_DISK || slowDisk == runs[r].disk ? runs[r].disk : -2;
+        if (slowDisk >= 0) {
+            guard.unlock();
+            for (size_t r = 0; r < runCnt; r++) {
+                if (runs[r].disk != slowDisk)
+                    continue;
+                helpers[r] = hedge->buffers.size();
+                for (int disk = 0; disk < devices; disk++)
+                    if (disk != slowDisk)
+                        issue(disk, runs[r].sector, runs[r].count);
             }
+            guard.lock();
         }
     }
 
-    if (raid.state == RAID_FAILED || raid.state == RAID_STOPPED)
+    // Evaluated when every helper read succeeded
+    auto evaluated = [&](size_t r) {
+        if (!helpers[r])
+            return false;
+        for (size_t i = helpers[r]; i < helpers[r] + devices - 1; i++)
+            if (hedge->state[i] != READ)
+                return false;
+        return true;
+    };
+    auto helpersFinished = [&](size_t r) {
+        for (size_t i = helpers[r]; i < helpers[r] + devices - 1; i++)
+            if (!finished(i))
+                return false;
+        return true;
+    };
+    hedge->cv.wait(guard, [&] {
+        for (size_t r = 0; r < runCnt; r++)
+            if ((helpers[r] && !helpersFinished(r)) || (!finished(r) && !evaluated(r)))
+                return false;
+        return true;
+    });
+    vector<int> state(hedge->state.begin(), hedge->state.end());
+    vector<DiskRun> failedHelpers;
+    for (size_t i = runCnt; i < state.size(); i++)
+        if (state[i] == FAILED)
+            failedHelpers.push_back({hedge->disks[i], 0, 0, nullptr, false});
+    guard.unlock();
+
+    // Buffers of finished reads are no longer written
+    for (size_t r = 0; r < runCnt; r++) {
+        DiskRun &run = runs[r];
+        size_t bytes = (size_t) run.count * SECTOR_SIZE;
+        if (state[r] != PENDING) {
+            run.done = state[r] == READ;
+            if (run.done)
+                memcpy(run.data, hedge->buffers[r].get(), bytes);
+            continue;
+        }
+        const unsigned char *src[MAX_RAID_DEVICES];
+        for (int i = 0; i < devices - 1; i++)
+            src[i] = hedge->buffers[helpers[r] + i].get();
+        xorParity(run.data, src, devices - 1, bytes);
+        run.done = true;
+        statistics.hedged(run.disk);
+    }
+    bool valid = finishRuns(runs);
+    finishRuns(failedHelpers);
+    return valid;
+}
+
+// Latency percentile of the median member, a single slow member does not move it
+unsigned long long CRaidVolume::typicalLatency(double percentile) const {
+    vector<unsigned long long> latency;
+    for (int disk = 0; disk < raid.dev.m_Devices; disk++)
+        latency.push_back(statistics.latencyPercentile(disk, percentile));
+    if (latency.empty())
+        return 0;
+    nth_element(latency.begin(), latency.begin() + latency.size() / 2, latency.end());
+    return latency[latency.size() / 2];
+}
+
+// Update RAID state for failed runs of a finished transfer
+bool CRaidVolume::finishRuns(const vector<DiskRun> &runs) {
+    bool valid = true;
+    bool lostProgress = false;
+    for (const DiskRun &run : runs)
+        if (!run.done) {
+            lostProgress |= markFailed(run.disk);
+            valid = false;
+        }
+
+    // Rebuilt part of the failed disk is no longer trusted
+    if (lostProgress)
+        saveOverhead();
+    return valid;
+}
+
+// Write the overhead of the running RAID to every disk except the failed one
+void CRaidVolume::saveOverhead() {
+    lock_guard<mutex> guard(overheadLock);
+    if (raid.state != RAID_OK && raid.state != RAID_DEGRADED)
+        return;
+
+    unsigned char buffer[SECTOR_SIZE];
+    writeToBuffer(currentOverhead(), buffer);
+    int failedDisk = raid.failedDisk;
+    vector<DiskRun> runs;
+    for (int disk = 0; disk < raid.dev.m_Devices; disk++)
+        if (disk != failedDisk)
+            runs.push_back({disk, raid.dev.m_Sectors - 1, 1, buffer, false});
+
+    CCompletion completion((int) runs.size());
+    startRuns(runs, true, completion);
+    completion.wait();
+    for (const DiskRun &run : runs)
+        if (!run.done)
+            markFailed(run.disk);
+}
+
+// Write the bitmap to every disk except the failed one unless 'version' is already there
+void CRaidVolume::saveBitmap(long long version) {
+    lock_guard<mutex> guard(bitmapLock);
+    if (bitmapVersion >= version)
+        return;
+
+    vector<unsigned char> bits((size_t) raid.bitmapSectors * SECTOR_SIZE);
+    bitmapVersion = bitmap->store(bits.data(), raid.bitmapSectors);
+    int failedDisk = raid.failedDisk;
+    vector<DiskRun> runs;
+    for (int disk = 0; disk < raid.dev.m_Devices; disk++)
+        if (disk != failedDisk)
+            runs.push_back({disk, raid.dev.m_Sectors - 1 - raid.bitmapSectors, raid.bitmapSectors, bits.data(), false});
+
+    CCompletion completion((int) runs.size());
+    startRuns(runs, true, completion);
+    completion.wait();
+    for (const DiskRun &run : runs)
+        if (!run.done)
+            markFailed(run.disk);
+}
+
+// Write the changed sectors of the allocation map unless 'version' is on the disks already
+void CRaidVolume::saveAllocation(long long version) {
+    lock_guard<mutex> guard(allocationLock);
+    if (allocationVersion >= version)
+        return;
+
+    vector<int> changed;
+    vector<unsigned char> sectors;
+    allocationVersion = allocation->store(changed, sectors);
+    TSector first = raid.dev.m_Sectors - 1 - raid.bitmapSectors - raid.allocSectors;
+    int failedDisk = raid.failedDisk;
+    vector<DiskRun> runs;
+    for (size_t i = 0, next; i < changed.size(); i = next) {
+        for (next = i + 1; next < changed.size() && changed[next] == changed[next - 1] + 1; next++);
+        for (int disk = 0; disk < raid.dev.m_Devices; disk++)
+            if (disk != failedDisk)
+                runs.push_back({disk, first + changed[i], (int) (next - i), &sectors[i * SECTOR_SIZE], false});
+    }
+    if (runs.empty())
+        return;
+
+    CCompletion completion((int) runs.size());
+    startRuns(runs, true, completion);
+    completion.wait();
+    for (const DiskRun &run : runs)
+        if (!run.done)
+            markFailed(run.disk);
+}
+
+// Clear idle regions of a consistent RAID; a degraded RAID keeps them for the failed disk
+void CRaidVolume::clearBitmap(bool force) {
+    if (bitmap->clearIdle(force, [this] { return raid.state == RAID_OK; }))
+        saveBitmap(numeric_limits<long long>::max());
+}
+
+// Failed disk carries the overhead of this RAID: it dropped out while the bitmap tracked writes.
+// Volumes created without an id cannot tell a disk of another array, they always resync fully.
+bool CRaidVolume::bitmapCovers(int disk) {
+    if (!bitmap)
         return false;
 
-    return true;
+    unsigned char buffer[SECTOR_SIZE];
+    vector<DiskRun> runs{{disk, raid.dev.m_Sectors - 1, 1, buffer, false}};
+    CCompletion completion(1);
+    startRuns(runs, false, completion);
+    completion.wait();
+    if (!runs[0].done)
+        return false;
+
+    Overhead overhead = readFromBuffer(buffer);
+    return raid.volumeId && overhead.volumeId == raid.volumeId && overhead.chunkSectors == raid.chunkSectors
+           && overhead.bitmapSectors == raid.bitmapSectors && overhead.regionSectors == raid.regionSectors
+           && overhead.timestamp <= raid.timestamp;
 }
 
-// --- Private helper functions ---
+// Evaluate parity of dirty regions again after an unclean shutdown
+void CRaidVolume::repairParity() {
+    int devices = raid.dev.m_Devices;
+    int chunk = raid.chunkSectors;
+    TSector dataSectors = stripeCount() * chunk;
+    vector<unsigned char> loaded((size_t) devices * RESYNC_BATCH * SECTOR_SIZE);
+    auto slot = [&](int disk, int i) { return &loaded[((size_t) disk * RESYNC_BATCH + i) * SECTOR_SIZE]; };
+
+    for (TSector sector = 0; sector < dataSectors && raid.state == RAID_OK; sector += RESYNC_BATCH) {
+        int count = (int) min<TSector>(RESYNC_BATCH, dataSectors - sector);
+        if (!bitmap->dirty(sector, sector + count))
+            continue;
+
+        vector<DiskRun> reads;
+        for (int disk = 0; disk < devices; disk++)
+            reads.push_back({disk, sector, count, slot(disk, 0), false});
+        if (!transferRuns(reads, false))
+            return;
+
+        vector<SectorIo> writes;
+        for (int i = 0; i < count; i++) {
+            int diskParity = (int) ((sector + i) / chunk % devices);
+            const unsigned char *src[MAX_RAID_DEVICES];
+            int srcCnt = 0;
+            for (int disk = 0; disk < devices; disk++)
+                if (disk != diskParity)
+                    src[srcCnt++] = slot(disk, i);
+            xorParity(slot(diskParity, i), src, srcCnt, SECTOR_SIZE);
+            writes.push_back({diskParity, sector + i, slot(diskParity, i)});
+        }
+        writeBatch(writes);
+    }
 
-// Map logical sector to physical disk/sector and parity disk
-CRaidVolume::Evaluation CRaidVolume::findSector(int input) const {
-    Evaluation res{};
-    res.sector = input / (raid.dev.m_Devices - 1);
-    res.diskParity = res.sector % raid.dev.m_Devices;
-    res.disk = input % (raid.dev.m_Devices - 1);
-    if (res.disk >= res.diskParity)
-        res.disk++;
-    return res;
-}
-
-// Read a single sector and update RAID state if read fails
-bool CRaidVolume::myRead(int disk, int sector, unsigned char *data) {
-    if (!raid.dev.m_Read(disk, sector, data, 1)) {
-        // Failed reading
-        raid.failedDisk = disk;
-        if (raid.state == RAID_OK)
-            raid.state = RAID_DEGRADED;
-        else
-            raid.state = RAID_FAILED;
+    clearBitmap(true);
+}
+
+// One pointer per sector of scatter-gather segments. A sector split between segments gets a slot
+// in 'bounce', filled from the segments, or copied back to them if 'scatter'.
+bool CRaidVolume::mapSegments(const iovec *iov, int iovCnt, vector<unsigned char *> &sectors,
+                              vector<unsigned char> &bounce, bool scatter) {
+    size_t total = 0;
+    int split = 0;
+    for (int i = 0; i < iovCnt; i++)
+        total += iov[i].iov_len;
+    if (iovCnt <= 0 || total == 0 || total % SECTOR_SIZE != 0)
         return false;
+
+    if (!scatter) {
+        sectors.assign(total / SECTOR_SIZE, nullptr);
+        bounce.resize(total);
     }
+
+    size_t offset = 0; // within segment 'seg'
+    for (size_t s = 0, seg = 0; s < total / SECTOR_SIZE; s++) {
+        while (offset == iov[seg].iov_len) {
+            seg++;
+            offset = 0;
+        }
+
+        auto *base = (unsigned char *) iov[seg].iov_base;
+        if (iov[seg].iov_len - offset >= (size_t) SECTOR_SIZE) {
+            if (!scatter)
+                sectors[s] = base + offset;
+            offset += SECTOR_SIZE;
+            continue;
+        }
+
+        // Sector split between segments
+        unsigned char *slot = &bounce[(size_t) split++ * SECTOR_SIZE];
+        if (!scatter)
+            sectors[s] = slot;
+        for (size_t copied = 0; copied < (size_t) SECTOR_SIZE;) {
+            while (offset == iov[seg].iov_len) {
+                seg++;
+                offset = 0;
+            }
+            size_t len = min(iov[seg].iov_len - offset, SECTOR_SIZE - copied);
+            base = (unsigned char *) iov[seg].iov_base + offset;
+            if (scatter)
+                memcpy(base, slot + copied, len);
+            else
+                memcpy(slot + copied, base, len);
+            copied += len;
+            offset += len;
+        }
+    }
+
+    if (!scatter)
+        bounce.resize((size_t) split * SECTOR_SIZE);
     return true;
 }
 
-// Write a single sector and update RAID state if write fails
-bool CRaidVolume::myWrite(int disk, int sector, const unsigned char *data) {
-    if (!raid.dev.m_Write(disk, sector, data, 1)) {
-        // Failed
+// Read sectors and update RAID state if read fails
+bool CRaidVolume::myRead(int disk, TSector sector, unsigned char *data, int secCnt) {
+    vector<DiskRun> runs{{disk, sector, secCnt, data, false}};
+    return transferRuns(runs, false);
+}
+
+// Write sectors and update RAID state if write fails
+bool CRaidVolume::myWrite(int disk, TSector sector, const unsigned char *data, int secCnt) {
+    vector<DiskRun> runs{{disk, sector, secCnt, const_cast<unsigned char *>(data), false}};
+    return transferRuns(runs, true);
+}
+
+// Failed disk to avoid at a physical sector: the rebuilt part of a failed disk is kept up to date
+int CRaidVolume::failedDiskAt(TSector sector, int failedDisk) const {
+    return sector < raid.resyncSector ? NO_DISK : failedDisk;
+}
+
+// Failed disk of a degraded RAID, NO_DISK otherwise; state and disk are read consistently
+int CRaidVolume::degradedDisk() const {
+    lock_guard<mutex> guard(stateLock);
+    return raid.state == RAID_DEGRADED ? raid.failedDisk.load() : NO_DISK;
+}
+
+// Record a failed disk: first failure degrades the RAID, failure of another disk fails it.
+// Returns true if the failed disk lost its partially rebuilt area.
+bool CRaidVolume::markFailed(int disk) {
+    lock_guard<mutex> guard(stateLock);
+    memberErrors++;
+    if (raid.state == RAID_OK) {
+        raid.state = RAID_DEGRADED;
         raid.failedDisk = disk;
-        if (raid.state == RAID_OK)
-            raid.state = RAID_DEGRADED;
-        else
-            raid.state = RAID_FAILED;
-        return false;
+        raid.resyncSector = 0;
+    } else if (raid.state != RAID_DEGRADED || raid.failedDisk != disk) {
+        raid.state = RAID_FAILED;
+        raid.failedDisk = disk;
+    } else {
+        // Failed disk failed again: a running resync restarts from scratch
+        failEpoch++;
+        if (raid.resyncSector > 0) {
+            raid.resyncSector = 0;
+            return true;
+        }
     }
-    return true;
+    return false;
 }
@@ -0,0 +1,41 @@
+#include "../include/CRangeLock.h"
+
+using namespace std;
+
+CRangeLock::CRangeLock(bool fair) : nextHandle(0), fair(fair) {}
+
+int CRangeLock::lock(TSector first, TSector last, bool exclusive) {
+    unique_lock<mutex> lock(guard);
+    if (conflicts(first, last, exclusive, waiting.end())) {
+        Waiter waiter{first, last, exclusive, {}};
+        auto it = waiting.insert(waiting.end(), &waiter);
+        waiter.released.wait(lock, [&] { return !conflicts(first, last, exclusive, it); });
+        waiting.erase(it);
+    }
+    held.push_back({first, last, exclusive, nextHandle});
+    return nextHandle++;
+}
+
+void CRangeLock::unlock(int handle) {
+    lock_guard<mutex> lock(guard);
+    for (auto it = held.begin(); it != held.end(); ++it)
+        if (it->handle == handle) {
+            for (Waiter *waiter : waiting)
+                if (waiter->first < it->last && it->first < waiter->last)
+                    waiter->released.notify_one();
+            held.erase(it);
+            break;
+        }
+}
+
+// Check a requested range against all held ranges and, if fair, against requests queued before 'queued'
+bool CRangeLock::conflicts(TSector first, TSector last, bool exclusive, list<Waiter *>::const_iterator queued) const {
+    for (const Range &range : held)
+        if ((exclusive || range.exclusive) && first < range.last && range.first < last)
+            return true;
+    if (fair)
+        for (auto it = waiting.begin(); it != queued; ++it)
+            if ((exclusive || (*it)->exclusive) && first < (*it)->last && (*it)->first < last)
+                return true;
+    return false;
+}
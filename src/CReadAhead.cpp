@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <cstring>
+#include "../include/TBlkDev.h"
+#include "../include/CReadAhead.h"
+
+using namespace std;
+
+// Sequential streams followed at the same time
+constexpr int MAX_STREAMS = 8;
+
+// Sectors loaded ahead of a newly detected stream, and the most a window grows to
+constexpr int MIN_WINDOW = 32;
+constexpr int MAX_WINDOW = 4096;
+
+// Reads of other streams after which a stream is idle and its window may be evicted
+constexpr int IDLE_ACCESSES = 2 * MAX_STREAMS;
+
+CReadAhead::CReadAhead(size_t budget, int stripeSectors, TSector volumeSectors, Fetch fetch)
+        : stripeSectors(stripeSectors), volumeSectors(volumeSectors),
+          capacity(max<size_t>(stripeSectors, budget / SECTOR_SIZE)), loadedSectors(0), fetch(move(fetch)),
+          clock(0), counters(), stopping(false) {
+    maxWindow = max(stripeSectors, (int) min<size_t>(MAX_WINDOW, capacity / 2) / stripeSectors * stripeSectors);
+    worker = thread([this] { run(); });
+}
+
+CReadAhead::~CReadAhead() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        changed.notify_all();
+    }
+    worker.join();
+}
+
+int CReadAhead::read(TSector secNr, int secCnt, const Copy &copy) {
+    unique_lock<mutex> guard(lock);
+    int served = 0;
+    while (served < secCnt) {
+        auto extent = find(secNr + served);
+        if (extent == extents.end())
+            break;
+        if (!extent->ready) {
+            // Loading already, cheaper than reading the disks again
+            changed.wait(guard);
+            continue;
+        }
+
+        int offset = (int) (secNr + served - extent->first);
+        int count = min(extent->count - offset, secCnt - served);
+        copy(served, &extent->data[(size_t) offset * SECTOR_SIZE], count);
+        extent->used += count;
+        served += count;
+
+        // Consumed by the stream, make room for the next window
+        if (offset + count == extent->count)
+            drop(extent);
+    }
+
+    counters.hitSectors += served;
+    counters.missSectors += secCnt - served;
+    follow(secNr, secCnt, served > 0);
+    return served;
+}
+
+void CReadAhead::invalidate(TSector first, TSector last) {
+    lock_guard<mutex> guard(lock);
+    for (auto it = extents.begin(); it != extents.end();) {
+        auto extent = it++;
+        if (extent->first >= last || first >= extent->first + extent->count)
+            continue;
+        if (extent->ready)
+            drop(extent);
+        else
+            extent->stale = true;
+    }
+}
+
+TReadAheadStats CReadAhead::stats() const {
+    lock_guard<mutex> guard(lock);
+    TReadAheadStats snapshot = counters;
+    snapshot.streams = (int) streams.size();
+    return snapshot;
+}
+
+// Valid extent holding a sector, loaded or being loaded
+list<CReadAhead::Extent>::iterator CReadAhead::find(TSector sector) {
+    for (auto it = extents.begin(); it != extents.end(); ++it)
+        if (!it->stale && sector >= it->first && sector < it->first + it->count)
+            return it;
+    return extents.end();
+}
+
+// Continue the stream ending at 'secNr' or start a new one; keep a window loaded ahead of it
+void CReadAhead::follow(TSector secNr, int secCnt, bool hit) {
+    TSector end = secNr + secCnt;
+    auto stream = find_if(streams.begin(), streams.end(), [&](const Stream &s) { return s.next == secNr; });
+    if (stream == streams.end()) {
+        // Not sequential yet: replace the least recently used stream
+        if (streams.size() < MAX_STREAMS)
+            streams.push_back({});
+        stream = min_element(streams.begin(), streams.end(),
+                             [](const Stream &a, const Stream &b) { return a.used < b.used; });
+        int window = (max(MIN_WINDOW, 2 * secCnt) + stripeSectors - 1) / stripeSectors * stripeSectors;
+        *stream = {end, min(window, maxWindow), end, ++clock};
+        return;
+    }
+
+    stream->next = end;
+    stream->used = ++clock;
+    if (hit)
+        stream->window = min(2 * stream->window, maxWindow);
+
+    // Top up once half of the window is consumed, the end stays stripe aligned
+    TSector first = max(stream->prefetchEnd, end);
+    if (first - end >= stream->window / 2)
+        return;
+    TSector last = min(volumeSectors, (end + stream->window + stripeSectors - 1) / stripeSectors * stripeSectors);
+    if (first >= last)
+        return;
+    if (prefetch(first, last, stream->used))
+        stream->prefetchEnd = last;
+    else
+        // Budget shared with other active streams, stay within a smaller window
+        stream->window = max(stripeSectors, stream->window / 2 / stripeSectors * stripeSectors);
+}
+
+// Queue a load of sectors [first, last) for the stream used at 'used'. Loaded extents of idle
+// streams make room for it; false if the budget is taken by active streams.
+bool CReadAhead::prefetch(TSector first, TSector last, long long used) {
+    size_t count = last - first;
+    while (loadedSectors + count > capacity) {
+        // Extent whose most recent stream heading for it is the least recently used
+        auto victim = extents.end();
+        long long victimUsed = used - IDLE_ACCESSES;
+        for (auto it = extents.begin(); it != extents.end(); ++it) {
+            long long heading = 0;
+            for (const Stream &s : streams)
+                if (it->first < s.prefetchEnd && s.next < it->first + it->count)
+                    heading = max(heading, s.used);
+            if (it->ready && heading < victimUsed) {
+                victim = it;
+                victimUsed = heading;
+            }
+        }
+        if (victim == extents.end())
+            return false;
+        drop(victim);
+    }
+
+    extents.push_back({first, (int) (last - first), false, false, 0, vector<unsigned char>(count * SECTOR_SIZE)});
+    loadedSectors += count;
+    pending.push_back(prev(extents.end()));
+    changed.notify_all();
+    return true;
+}
+
+void CReadAhead::drop(list<Extent>::iterator extent) {
+    counters.discardedSectors += extent->count - min(extent->used, extent->count);
+    loadedSectors -= extent->count;
+    extents.erase(extent);
+}
+
+// Load queued extents one at a time, each as one read of whole stripes from all members
+void CReadAhead::run() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [this] { return stopping || !pending.empty(); });
+        if (stopping)
+            break;
+
+        auto extent = pending.front();
+        pending.pop_front();
+        if (extent->stale) {
+            drop(extent);
+            continue;
+        }
+        guard.unlock();
+        bool valid = fetch(extent->first, extent->data.data(), extent->count);
+        guard.lock();
+
+        if (valid && !extent->stale) {
+            extent->ready = true;
+            counters.prefetchedSectors += extent->count;
+        } else
+            drop(extent);
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "../include/TBlkDev.h"
+#include "../include/CStripeCache.h"
+#include "../include/XorEngine.h"
+
+using namespace std;
+
+// Background flush period
+constexpr auto FLUSH_INTERVAL = chrono::milliseconds(100);
+
+CStripeCache::CStripeCache(int devices, size_t budget)
+        : devices(devices), capacity(max<size_t>(1, budget / ((size_t) devices * SECTOR_SIZE))),
+          dirtyRows(0), counters(), stopping(false) {}
+
+CStripeCache::~CStripeCache() {
+    stopFlusher();
+}
+
+bool CStripeCache::read(TSector row, int disk, unsigned char *data) {
+    lock_guard<mutex> guard(lock);
+    auto entry = find(row);
+    if (entry == lru.end()) {
+        counters.readMisses++;
+        return false;
+    }
+
+    memcpy(data, &entry->sectors[(size_t) disk * SECTOR_SIZE], SECTOR_SIZE);
+    counters.readHits++;
+    return true;
+}
+
+bool CStripeCache::write(TSector row, int diskParity, const int *disks, const unsigned char *const *data, int cnt) {
+    lock_guard<mutex> guard(lock);
+    auto entry = find(row);
+    if (entry == lru.end()) {
+        counters.writeMisses++;
+        return false;
+    }
+
+    // Parity ^= old data ^ new data, then replace old data
+    unsigned char *parity = &entry->sectors[(size_t) diskParity * SECTOR_SIZE];
+    const unsigned char *src[2 * MAX_RAID_DEVICES];
+    for (int i = 0; i < cnt; i++) {
+        src[2 * i] = &entry->sectors[(size_t) disks[i] * SECTOR_SIZE];
+        src[2 * i + 1] = data[i];
+    }
+    xorBlocks(parity, src, 2 * cnt, SECTOR_SIZE);
+
+    if (!entry->dirty)
+        dirtyRows++;
+    entry->dirty |= 1u << diskParity;
+    for (int i = 0; i < cnt; i++) {
+        memcpy(&entry->sectors[(size_t) disks[i] * SECTOR_SIZE], data[i], SECTOR_SIZE);
+        entry->dirty |= 1u << disks[i];
+    }
+    counters.writeHits++;
+
+    if (dirtyRows > capacity / 2)
+        wake.notify_one();
+    return true;
+}
+
+void CStripeCache::insert(TSector row, const unsigned char *sectors, uint32_t dirty) {
+    lock_guard<mutex> guard(lock);
+    size_t bytes = (size_t) devices * SECTOR_SIZE;
+    auto entry = find(row);
+
+    if (entry == lru.end()) {
+        lru.push_front({row, 0, 0, vector<unsigned char>(sectors, sectors + bytes)});
+        entry = lru.begin();
+        index[row] = entry;
+    } else
+        memcpy(entry->sectors.data(), sectors, bytes);
+
+    if (!entry->dirty && dirty)
+        dirtyRows++;
+    entry->dirty |= dirty;
+}
+
+int CStripeCache::collect(vector<TSector> &rows, vector<uint32_t> &masks, vector<unsigned char> &sectors, int maxRows) {
+    lock_guard<mutex> guard(lock);
+    size_t bytes = (size_t) devices * SECTOR_SIZE;
+    rows.clear();
+    masks.clear();
+    sectors.clear();
+
+    for (auto entry = lru.begin(); entry != lru.end() && (int) rows.size() < maxRows; ++entry) {
+        if (!entry->dirty)
+            continue;
+        rows.push_back(entry->row);
+        masks.push_back(entry->dirty);
+        sectors.insert(sectors.end(), entry->sectors.begin(), entry->sectors.begin() + bytes);
+        entry->dirty = 0;
+        entry->flushing++;
+        dirtyRows--;
+    }
+
+    counters.flushedRows += rows.size();
+    return (int) rows.size();
+}
+
+void CStripeCache::release(const vector<TSector> &rows) {
+    lock_guard<mutex> guard(lock);
+    for (TSector row : rows) {
+        auto it = index.find(row);
+        if (it != index.end())
+            it->second->flushing--;
+    }
+}
+
+void CStripeCache::discard(TSector first, TSector last) {
+    lock_guard<mutex> guard(lock);
+    for (auto entry = lru.begin(); entry != lru.end();) {
+        if (entry->row < first || entry->row >= last) {
+            ++entry;
+            continue;
+        }
+        if (entry->dirty)
+            dirtyRows--;
+        index.erase(entry->row);
+        entry = lru.erase(entry);
+    }
+}
+
+bool CStripeCache::evict() {
+    lock_guard<mutex> guard(lock);
+    auto entry = lru.end();
+    while (lru.size() > capacity && entry != lru.begin()) {
+        --entry;
+        if (entry->dirty || entry->flushing)
+            continue;
+        index.erase(entry->row);
+        entry = lru.erase(entry);
+        counters.evictions++;
+    }
+    return lru.size() <= capacity;
+}
+
+TCacheStats CStripeCache::stats() const {
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
+
+void CStripeCache::startFlusher(function<void()> flush) {
+    stopping = false;
+    flusher = thread([this, flush] {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, FLUSH_INTERVAL, [this] { return stopping || dirtyRows > capacity / 2; });
+            if (stopping)
+                break;
+            if (!dirtyRows)
+                continue;
+            guard.unlock();
+            flush();
+            guard.lock();
+        }
+    });
+}
+
+void CStripeCache::stopFlusher() {
+    if (!flusher.joinable())
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        wake.notify_one();
+    }
+    flusher.join();
+}
+
+// Look up a row and mark it most recently used
+list<CStripeCache::Entry>::iterator CStripeCache::find(TSector row) {
+    auto it = index.find(row);
+    if (it == index.end())
+        return lru.end();
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second;
+}
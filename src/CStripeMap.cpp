@@ -0,0 +1,21 @@
+#include "../include/CStripeMap.h"
+
+using namespace std;
+
+CStripeMap::CStripeMap() : CStripeMap(3, 1) {}
+
+// Data disks skip the parity disk of the row
+CStripeMap::CStripeMap(int devices, int chunkSectors)
+        : devices(devices), chunkSectors(chunkSectors), stripeSize(chunkSectors * (devices - 1)) {
+    rotation.reserve((size_t) devices * (devices - 1));
+    for (int parity = 0; parity < devices; parity++)
+        for (int disk = 0; disk < devices; disk++)
+            if (disk != parity)
+                rotation.push_back(disk);
+}
+
+TStripeSegment CStripeMap::locate(TSector secNr) const {
+    TStripeSegment segment{};
+    forEach(secNr, 1, [&segment](const TStripeSegment &s) { segment = s; });
+    return segment;
+}
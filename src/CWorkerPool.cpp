@@ -0,0 +1,69 @@
+#include "../include/CWorkerPool.h"
+
+using namespace std;
+
+CCompletion::CCompletion(int count, function<void()> finished) : pending(count), finished(move(finished)) {}
+
+// Mark one operation finished
+void CCompletion::done() {
+    function<void()> last;
+    {
+        lock_guard<mutex> guard(lock);
+        if (--pending == 0) {
+            cv.notify_all();
+            last = move(finished);
+        }
+    }
+    if (last)
+        last();
+}
+
+// Block until all operations finished
+void CCompletion::wait() {
+    unique_lock<mutex> guard(lock);
+    cv.wait(guard, [this] { return pending == 0; });
+}
+
+// Start a worker for each lane
+CWorkerPool::CWorkerPool(int lanes) {
+    for (int i = 0; i < lanes; i++) {
+        queues.emplace_back(new Queue);
+        Queue &queue = *queues.back();
+        queue.worker = thread([&queue] { run(queue); });
+    }
+}
+
+// Finish queued operations and join workers
+CWorkerPool::~CWorkerPool() {
+    for (auto &queue : queues) {
+        lock_guard<mutex> guard(queue->lock);
+        queue->stopped = true;
+        queue->cv.notify_one();
+    }
+    for (auto &queue : queues)
+        queue->worker.join();
+}
+
+// Queue an operation on the worker of 'lane'
+void CWorkerPool::submit(int lane, function<void()> task) {
+    Queue &queue = *queues[lane];
+    lock_guard<mutex> guard(queue.lock);
+    queue.tasks.push_back(move(task));
+    queue.cv.notify_one();
+}
+
+// Worker loop: run operations until stopped and drained
+void CWorkerPool::run(Queue &queue) {
+    for (;;) {
+        function<void()> task;
+        {
+            unique_lock<mutex> guard(queue.lock);
+            queue.cv.wait(guard, [&queue] { return queue.stopped || !queue.tasks.empty(); });
+            if (queue.tasks.empty())
+                return;
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        task();
+    }
+}
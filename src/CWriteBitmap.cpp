@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <chrono>
+#include "../include/TBlkDev.h"
+#include "../include/CWriteBitmap.h"
+
+using namespace std;
+
+// Period of the cleaner, an idle region is cleared after one or two periods
+constexpr auto CLEAR_INTERVAL = chrono::milliseconds(1000);
+
+CWriteBitmap::CWriteBitmap(TSector regions, int regionSectors)
+        : regionSectors(regionSectors), regions((size_t) regions, REGION_CLEAN), inFlight((size_t) regions, 0),
+          setVersion((size_t) regions, 0), version(0), stopping(false) {}
+
+CWriteBitmap::~CWriteBitmap() {
+    stopCleaner();
+}
+
+long long CWriteBitmap::begin(TSector first, TSector last) {
+    lock_guard<mutex> guard(lock);
+    long long required = 0;
+    for (TSector r = first / regionSectors; r <= (last - 1) / regionSectors; r++) {
+        if (regions[r] == REGION_CLEAN)
+            setVersion[r] = ++version;
+        regions[r] = REGION_DIRTY;
+        inFlight[r]++;
+        required = max(required, setVersion[r]);
+    }
+    return required;
+}
+
+void CWriteBitmap::end(TSector first, TSector last) {
+    lock_guard<mutex> guard(lock);
+    for (TSector r = first / regionSectors; r <= (last - 1) / regionSectors; r++)
+        inFlight[r]--;
+}
+
+bool CWriteBitmap::dirty(TSector first, TSector last) const {
+    lock_guard<mutex> guard(lock);
+    for (TSector r = first / regionSectors; r <= (last - 1) / regionSectors; r++)
+        if (regions[r] != REGION_CLEAN)
+            return true;
+    return false;
+}
+
+bool CWriteBitmap::empty() const {
+    lock_guard<mutex> guard(lock);
+    return all_of(regions.begin(), regions.end(), [](RegionState state) { return state == REGION_CLEAN; });
+}
+
+bool CWriteBitmap::clearIdle(bool force, const function<bool()> &allowed) {
+    lock_guard<mutex> guard(lock);
+    if (!allowed())
+        return false;
+
+    bool changed = false;
+    for (size_t r = 0; r < regions.size(); r++) {
+        if (regions[r] == REGION_CLEAN || inFlight[r])
+            continue;
+        if (regions[r] == REGION_DIRTY && !force) {
+            regions[r] = REGION_IDLE;
+            continue;
+        }
+        regions[r] = REGION_CLEAN;
+        version++;
+        changed = true;
+    }
+    return changed;
+}
+
+long long CWriteBitmap::store(unsigned char *sectors, int sectorCnt) const {
+    lock_guard<mutex> guard(lock);
+    fill(sectors, sectors + (size_t) sectorCnt * SECTOR_SIZE, 0);
+    for (size_t r = 0; r < regions.size(); r++)
+        if (regions[r] != REGION_CLEAN)
+            sectors[r / 8] |= (unsigned char) (1 << r % 8);
+    return version;
+}
+
+void CWriteBitmap::load(const unsigned char *sectors, int sectorCnt) {
+    lock_guard<mutex> guard(lock);
+    for (size_t r = 0; r < regions.size() && r / 8 < (size_t) sectorCnt * SECTOR_SIZE; r++)
+        if (sectors[r / 8] >> r % 8 & 1)
+            regions[r] = REGION_DIRTY;
+}
+
+void CWriteBitmap::startCleaner(function<void()> clear) {
+    stopping = false;
+    cleaner = thread([this, clear] {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, CLEAR_INTERVAL, [this] { return stopping; });
+            if (stopping)
+                break;
+            guard.unlock();
+            clear();
+            guard.lock();
+        }
+    });
+}
+
+void CWriteBitmap::stopCleaner() {
+    if (!cleaner.joinable())
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        wake.notify_one();
+    }
+    cleaner.join();
+}
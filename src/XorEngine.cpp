@@ -0,0 +1,183 @@
+#include <cstdint>
+#include "../include/XorEngine.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XOR_X86 1
+#endif
+
+using namespace std;
+
+// Tails of vector kernels keep per-source pointers on the stack
+constexpr int MAX_XOR_SOURCES = 64;
+
+typedef void (*XorFunc)(unsigned char *, const unsigned char *const *, int, size_t);
+
+// Portable kernel: 64-bit words, unaligned buffers are handled by memcpy
+static void xorScalar(unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    size_t pos = 0;
+    for (; pos + sizeof(uint64_t) <= len; pos += sizeof(uint64_t)) {
+        uint64_t acc, word;
+        memcpy(&acc, dst + pos, sizeof(uint64_t));
+        for (int i = 0; i < srcCnt; i++) {
+            memcpy(&word, src[i] + pos, sizeof(uint64_t));
+            acc ^= word;
+        }
+        memcpy(dst + pos, &acc, sizeof(uint64_t));
+    }
+
+    // Remaining bytes
+    for (; pos < len; pos++)
+        for (int i = 0; i < srcCnt; i++)
+            dst[pos] ^= src[i][pos];
+}
+
+#ifdef XOR_X86
+
+__attribute__((target("sse2")))
+static void xorSse2(unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *) (dst + pos));
+        __m128i a1 = _mm_loadu_si128((const __m128i *) (dst + pos + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *) (dst + pos + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *) (dst + pos + 48));
+        for (int i = 0; i < srcCnt; i++) {
+            const unsigned char *s = src[i] + pos;
+            a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *) s));
+            a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *) (s + 16)));
+            a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *) (s + 32)));
+            a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *) (s + 48)));
+        }
+        _mm_storeu_si128((__m128i *) (dst + pos), a0);
+        _mm_storeu_si128((__m128i *) (dst + pos + 16), a1);
+        _mm_storeu_si128((__m128i *) (dst + pos + 32), a2);
+        _mm_storeu_si128((__m128i *) (dst + pos + 48), a3);
+    }
+
+    if (pos < len) {
+        const unsigned char *tail[MAX_XOR_SOURCES];
+        for (int i = 0; i < srcCnt; i++)
+            tail[i] = src[i] + pos;
+        xorScalar(dst + pos, tail, srcCnt, len - pos);
+    }
+}
+
+__attribute__((target("avx2")))
+static void xorAvx2(unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    size_t pos = 0;
+    for (; pos + 128 <= len; pos += 128) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *) (dst + pos));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *) (dst + pos + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *) (dst + pos + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *) (dst + pos + 96));
+        for (int i = 0; i < srcCnt; i++) {
+            const unsigned char *s = src[i] + pos;
+            a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *) s));
+            a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *) (s + 32)));
+            a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *) (s + 64)));
+            a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *) (s + 96)));
+        }
+        _mm256_storeu_si256((__m256i *) (dst + pos), a0);
+        _mm256_storeu_si256((__m256i *) (dst + pos + 32), a1);
+        _mm256_storeu_si256((__m256i *) (dst + pos + 64), a2);
+        _mm256_storeu_si256((__m256i *) (dst + pos + 96), a3);
+    }
+
+    if (pos < len) {
+        const unsigned char *tail[MAX_XOR_SOURCES];
+        for (int i = 0; i < srcCnt; i++)
+            tail[i] = src[i] + pos;
+        xorSse2(dst + pos, tail, srcCnt, len - pos);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void xorAvx512(unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    size_t pos = 0;
+    for (; pos + 256 <= len; pos += 256) {
+        __m512i a0 = _mm512_loadu_si512((const void *) (dst + pos));
+        __m512i a1 = _mm512_loadu_si512((const void *) (dst + pos + 64));
+        __m512i a2 = _mm512_loadu_si512((const void *) (dst + pos + 128));
+        __m512i a3 = _mm512_loadu_si512((const void *) (dst + pos + 192));
+        for (int i = 0; i < srcCnt; i++) {
+            const unsigned char *s = src[i] + pos;
+            a0 = _mm512_xor_si512(a0, _mm512_loadu_si512((const void *) s));
+            a1 = _mm512_xor_si512(a1, _mm512_loadu_si512((const void *) (s + 64)));
+            a2 = _mm512_xor_si512(a2, _mm512_loadu_si512((const void *) (s + 128)));
+            a3 = _mm512_xor_si512(a3, _mm512_loadu_si512((const void *) (s + 192)));
+        }
+        _mm512_storeu_si512((void *) (dst + pos), a0);
+        _mm512_storeu_si512((void *) (dst + pos + 64), a1);
+        _mm512_storeu_si512((void *) (dst + pos + 128), a2);
+        _mm512_storeu_si512((void *) (dst + pos + 192), a3);
+    }
+
+    if (pos < len) {
+        const unsigned char *tail[MAX_XOR_SOURCES];
+        for (int i = 0; i < srcCnt; i++)
+            tail[i] = src[i] + pos;
+        xorAvx2(dst + pos, tail, srcCnt, len - pos);
+    }
+}
+
+#endif
+
+static const XorFunc g_Kernels[XOR_KERNELS] = {
+        xorScalar,
+#ifdef XOR_X86
+        xorSse2, xorAvx2, xorAvx512
+#else
+        nullptr, nullptr, nullptr
+#endif
+};
+
+// Pick the widest kernel the CPU supports
+static int selectKernel() {
+    for (int kernel = XOR_KERNELS - 1; kernel > XOR_SCALAR; kernel--)
+        if (xorSupported(kernel))
+            return kernel;
+    return XOR_SCALAR;
+}
+
+static const int g_Selected = selectKernel();
+
+static void xorChunked(XorFunc func, unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    for (; srcCnt > MAX_XOR_SOURCES; src += MAX_XOR_SOURCES, srcCnt -= MAX_XOR_SOURCES)
+        func(dst, src, MAX_XOR_SOURCES, len);
+    func(dst, src, srcCnt, len);
+}
+
+void xorBlocks(unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    xorChunked(g_Kernels[g_Selected], dst, src, srcCnt, len);
+}
+
+void xorBlocks(int kernel, unsigned char *dst, const unsigned char *const *src, int srcCnt, size_t len) {
+    xorChunked(g_Kernels[kernel], dst, src, srcCnt, len);
+}
+
+bool xorSupported(int kernel) {
+#ifdef XOR_X86
+    __builtin_cpu_init();
+    switch (kernel) {
+        case XOR_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case XOR_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case XOR_AVX512:
+            return __builtin_cpu_supports("avx512f");
+        default:
+            break;
+    }
+#endif
+    return kernel == XOR_SCALAR;
+}
+
+int xorKernel() {
+    return g_Selected;
+}
+
+const char *xorKernelName(int kernel) {
+    static const char *const names[XOR_KERNELS] = {"scalar", "sse2", "avx2", "avx512"};
+    return kernel >= 0 && kernel < XOR_KERNELS ? names[kernel] : "unknown";
+}